@@ -0,0 +1,161 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "lcfs-arena.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LCFS_ARENA_CHUNK_SIZE (1024 * 1024)
+#define LCFS_ARENA_ALIGN alignof(max_align_t)
+
+struct lcfs_arena_chunk_s {
+	struct lcfs_arena_chunk_s *next;
+	alignas(max_align_t) uint8_t data[];
+};
+
+struct lcfs_arena_s {
+	atomic_int ref_count;
+
+	pthread_mutex_t lock;
+	struct lcfs_arena_chunk_s *chunks; /* Current chunk first */
+	size_t used; /* In current chunk */
+};
+
+lcfs_arena_t *lcfs_arena_new(void)
+{
+	lcfs_arena_t *arena;
+
+	arena = calloc(1, sizeof(lcfs_arena_t));
+	if (arena == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	atomic_init(&arena->ref_count, 1);
+	pthread_mutex_init(&arena->lock, NULL);
+	/* Start out "full", so the first allocation adds a chunk */
+	arena->used = LCFS_ARENA_CHUNK_SIZE;
+
+	return arena;
+}
+
+lcfs_arena_t *lcfs_arena_ref(lcfs_arena_t *arena)
+{
+	atomic_fetch_add(&arena->ref_count, 1);
+	return arena;
+}
+
+void lcfs_arena_unref(lcfs_arena_t *arena)
+{
+	struct lcfs_arena_chunk_s *chunk, *next;
+
+	if (atomic_fetch_sub(&arena->ref_count, 1) > 1)
+		return;
+
+	for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	pthread_mutex_destroy(&arena->lock);
+	free(arena);
+}
+
+static struct lcfs_arena_chunk_s *lcfs_arena_new_chunk(size_t size)
+{
+	struct lcfs_arena_chunk_s *chunk;
+
+	chunk = malloc(sizeof(struct lcfs_arena_chunk_s) + size);
+	if (chunk == NULL)
+		errno = ENOMEM;
+
+	return chunk;
+}
+
+void *lcfs_arena_alloc(lcfs_arena_t *arena, size_t size)
+{
+	struct lcfs_arena_chunk_s *chunk;
+	void *res;
+
+	size = (size + LCFS_ARENA_ALIGN - 1) & ~(LCFS_ARENA_ALIGN - 1);
+
+	/* Large allocations get their own chunk, behind the current one
+	 * so the free space in that is not wasted */
+	if (size > LCFS_ARENA_CHUNK_SIZE / 4) {
+		chunk = lcfs_arena_new_chunk(size);
+		if (chunk == NULL)
+			return NULL;
+
+		pthread_mutex_lock(&arena->lock);
+		if (arena->chunks != NULL) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+			arena->used = LCFS_ARENA_CHUNK_SIZE;
+		}
+		pthread_mutex_unlock(&arena->lock);
+
+		return chunk->data;
+	}
+
+	pthread_mutex_lock(&arena->lock);
+
+	if (arena->used + size > LCFS_ARENA_CHUNK_SIZE) {
+		chunk = lcfs_arena_new_chunk(LCFS_ARENA_CHUNK_SIZE);
+		if (chunk == NULL) {
+			pthread_mutex_unlock(&arena->lock);
+			return NULL;
+		}
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->used = 0;
+	}
+
+	res = arena->chunks->data + arena->used;
+	arena->used += size;
+
+	pthread_mutex_unlock(&arena->lock);
+
+	return res;
+}
+
+void *lcfs_arena_memdup(lcfs_arena_t *arena, const void *data, size_t size)
+{
+	void *res;
+
+	res = lcfs_arena_alloc(arena, size);
+	if (res != NULL)
+		memcpy(res, data, size);
+
+	return res;
+}
+
+char *lcfs_arena_strdup(lcfs_arena_t *arena, const char *str)
+{
+	return lcfs_arena_memdup(arena, str, strlen(str) + 1);
+}
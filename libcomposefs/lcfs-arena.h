@@ -0,0 +1,39 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef _LCFS_ARENA_H
+#define _LCFS_ARENA_H
+
+#include <stddef.h>
+
+/* A thread safe, reference counted bump allocator.
+ *
+ * Allocations are carved out of large chunks and can't be freed
+ * individually, all the memory is released when the last reference
+ * is dropped.
+ */
+
+typedef struct lcfs_arena_s lcfs_arena_t;
+
+lcfs_arena_t *lcfs_arena_new(void);
+lcfs_arena_t *lcfs_arena_ref(lcfs_arena_t *arena);
+void lcfs_arena_unref(lcfs_arena_t *arena);
+
+void *lcfs_arena_alloc(lcfs_arena_t *arena, size_t size);
+void *lcfs_arena_memdup(lcfs_arena_t *arena, const void *data, size_t size);
+char *lcfs_arena_strdup(lcfs_arena_t *arena, const char *str);
+
+#endif
@@ -0,0 +1,419 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "lcfs-internal.h"
+#include "lcfs-writer.h"
+#include "lcfs-utils.h"
+#include "hash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The digest cache maps files, identified by (dev, ino) and validated
+ * by size, mtime and ctime, to their fs-verity digest.
+ *
+ * It is stored in a file with a header followed by fixed size entries
+ * sorted by (dev, ino), all little endian. The file is mmap:ed and
+ * searched in place, entries added during the build are kept in a hash
+ * table until the cache is saved, which writes a new file with the
+ * entries that were used or added (so files that went away don't stay
+ * around forever).
+ */
+
+#define DIGEST_CACHE_MAGIC "LCFSDCH\0"
+#define DIGEST_CACHE_VERSION 1
+
+struct digest_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t n_entries;
+};
+
+struct digest_cache_entry {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t ctime_sec;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint8_t digest[LCFS_DIGEST_SIZE];
+};
+
+/* Everything but the digest must match for an entry to be valid */
+#define DIGEST_CACHE_KEY_SIZE offsetof(struct digest_cache_entry, digest)
+
+struct lcfs_digest_cache_s {
+	char *path;
+	pthread_mutex_t lock;
+
+	/* From the file */
+	void *mapping;
+	size_t mapping_size;
+	const struct digest_cache_entry *entries;
+	size_t n_entries;
+	uint8_t *used;
+
+	/* New or updated entries */
+	Hash_table *added;
+};
+
+static void entry_from_stat(struct digest_cache_entry *entry, const struct stat *st)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->dev = htole64(st->st_dev);
+	entry->ino = htole64(st->st_ino);
+	entry->size = htole64(st->st_size);
+	entry->mtime_sec = htole64(st->st_mtim.tv_sec);
+	entry->mtime_nsec = htole32(st->st_mtim.tv_nsec);
+	entry->ctime_sec = htole64(st->st_ctim.tv_sec);
+	entry->ctime_nsec = htole32(st->st_ctim.tv_nsec);
+}
+
+static int cmp_entry_ids(const struct digest_cache_entry *a,
+			 const struct digest_cache_entry *b)
+{
+	uint64_t a_dev = le64toh(a->dev), b_dev = le64toh(b->dev);
+	uint64_t a_ino = le64toh(a->ino), b_ino = le64toh(b->ino);
+
+	if (a_dev != b_dev)
+		return a_dev < b_dev ? -1 : 1;
+	if (a_ino != b_ino)
+		return a_ino < b_ino ? -1 : 1;
+	return 0;
+}
+
+static int cmp_entry_ptrs(const void *a, const void *b)
+{
+	const struct digest_cache_entry *const *ea = a;
+	const struct digest_cache_entry *const *eb = b;
+
+	return cmp_entry_ids(*ea, *eb);
+}
+
+static size_t added_ht_hasher(const void *d, size_t n)
+{
+	const struct digest_cache_entry *entry = d;
+
+	return (entry->dev * 31 + entry->ino) % n;
+}
+
+static bool added_ht_comparator(const void *d1, const void *d2)
+{
+	return cmp_entry_ids(d1, d2) == 0;
+}
+
+static bool digest_cache_load(struct lcfs_digest_cache_s *cache, int fd)
+{
+	const struct digest_cache_header *header;
+	struct stat st;
+	void *mapping;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*header))
+		return false;
+
+	mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	header = mapping;
+	if (memcmp(header->magic, DIGEST_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+	    le32toh(header->version) != DIGEST_CACHE_VERSION ||
+	    le32toh(header->entry_size) != sizeof(struct digest_cache_entry) ||
+	    le64toh(header->n_entries) >
+		    (st.st_size - sizeof(*header)) / sizeof(struct digest_cache_entry) ||
+	    sizeof(*header) + le64toh(header->n_entries) *
+				      sizeof(struct digest_cache_entry) !=
+		    (size_t)st.st_size) {
+		munmap(mapping, st.st_size);
+		return false;
+	}
+
+	cache->mapping = mapping;
+	cache->mapping_size = st.st_size;
+	cache->entries = (const struct digest_cache_entry *)(header + 1);
+	cache->n_entries = le64toh(header->n_entries);
+
+	return true;
+}
+
+/* A missing or invalid cache file is not an error, we just start with
+ * an empty cache and create it on save. */
+struct lcfs_digest_cache_s *lcfs_digest_cache_open(const char *path)
+{
+	struct lcfs_digest_cache_s *cache;
+	cleanup_fd int fd = -1;
+	int errsv;
+
+	cache = calloc(1, sizeof(struct lcfs_digest_cache_s));
+	if (cache == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+
+	cache->path = strdup(path);
+	if (cache->path == NULL) {
+		errsv = ENOMEM;
+		goto fail;
+	}
+
+	cache->added = hash_initialize(0, NULL, added_ht_hasher,
+				       added_ht_comparator, free);
+	if (cache->added == NULL) {
+		errsv = ENOMEM;
+		goto fail;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return cache;
+		errsv = errno;
+		goto fail;
+	}
+
+	if (digest_cache_load(cache, fd) && cache->n_entries > 0) {
+		cache->used = calloc(cache->n_entries, 1);
+		if (cache->used == NULL) {
+			errsv = ENOMEM;
+			goto fail;
+		}
+	}
+
+	return cache;
+
+fail:
+	lcfs_digest_cache_free(cache);
+	errno = errsv;
+	return NULL;
+}
+
+void lcfs_digest_cache_free(struct lcfs_digest_cache_s *cache)
+{
+	if (cache == NULL)
+		return;
+
+	if (cache->mapping)
+		munmap(cache->mapping, cache->mapping_size);
+	if (cache->added)
+		hash_free(cache->added);
+	free(cache->used);
+	free(cache->path);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+static ssize_t digest_cache_find(struct lcfs_digest_cache_s *cache,
+				 const struct digest_cache_entry *key)
+{
+	size_t lo = 0, hi = cache->n_entries;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = cmp_entry_ids(key, &cache->entries[mid]);
+
+		if (cmp == 0)
+			return mid;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return -1;
+}
+
+/* Returns true and sets digest if there is a valid entry for the file */
+bool lcfs_digest_cache_lookup(struct lcfs_digest_cache_s *cache,
+			      const struct stat *st, uint8_t *digest)
+{
+	struct digest_cache_entry key;
+	const struct digest_cache_entry *entry;
+	bool found = false;
+
+	entry_from_stat(&key, st);
+
+	pthread_mutex_lock(&cache->lock);
+
+	entry = hash_lookup(cache->added, &key);
+	if (entry != NULL) {
+		found = memcmp(entry, &key, DIGEST_CACHE_KEY_SIZE) == 0;
+	} else {
+		ssize_t index = digest_cache_find(cache, &key);
+		if (index >= 0) {
+			entry = &cache->entries[index];
+			found = memcmp(entry, &key, DIGEST_CACHE_KEY_SIZE) == 0;
+			if (found)
+				cache->used[index] = 1;
+		}
+	}
+
+	if (found)
+		memcpy(digest, entry->digest, LCFS_DIGEST_SIZE);
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return found;
+}
+
+int lcfs_digest_cache_insert(struct lcfs_digest_cache_s *cache,
+			     const struct stat *st, const uint8_t *digest)
+{
+	struct digest_cache_entry *entry, *existing;
+	struct timespec now;
+
+	/* A file that was changed within the last second may be changed
+	 * again without the timestamps changing, so don't trust those */
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (st->st_mtim.tv_sec >= now.tv_sec - 1 || st->st_ctim.tv_sec >= now.tv_sec - 1)
+		return 0;
+
+	entry = malloc(sizeof(struct digest_cache_entry));
+	if (entry == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	entry_from_stat(entry, st);
+	memcpy(entry->digest, digest, LCFS_DIGEST_SIZE);
+
+	pthread_mutex_lock(&cache->lock);
+
+	existing = hash_lookup(cache->added, entry);
+	if (existing != NULL) {
+		memcpy(existing, entry, sizeof(struct digest_cache_entry));
+		free(entry);
+	} else if (hash_insert(cache->added, entry) == NULL) {
+		pthread_mutex_unlock(&cache->lock);
+		free(entry);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len > 0) {
+		ssize_t r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+/* Atomically replaces the cache file with the used and added entries */
+int lcfs_digest_cache_save(struct lcfs_digest_cache_s *cache)
+{
+	cleanup_free struct digest_cache_entry **added = NULL;
+	cleanup_free struct digest_cache_entry *out = NULL;
+	cleanup_free char *tmp_path = NULL;
+	struct digest_cache_header header = { 0 };
+	cleanup_fd int fd = -1;
+	size_t n_added, n_out = 0;
+	size_t i, j;
+	int errsv;
+
+	pthread_mutex_lock(&cache->lock);
+
+	n_added = hash_get_n_entries(cache->added);
+	added = calloc(n_added + 1, sizeof(struct digest_cache_entry *));
+	out = calloc(n_added + cache->n_entries + 1, sizeof(struct digest_cache_entry));
+	if (added == NULL || out == NULL) {
+		pthread_mutex_unlock(&cache->lock);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	n_added = hash_get_entries(cache->added, (void **)added, n_added);
+	qsort(added, n_added, sizeof(struct digest_cache_entry *), cmp_entry_ptrs);
+
+	/* Merge, the added entries replace old ones for the same file */
+	for (i = 0, j = 0; i < n_added || j < cache->n_entries;) {
+		int cmp;
+
+		if (j == cache->n_entries)
+			cmp = -1;
+		else if (i == n_added)
+			cmp = 1;
+		else
+			cmp = cmp_entry_ids(added[i], &cache->entries[j]);
+
+		if (cmp <= 0) {
+			out[n_out++] = *added[i++];
+			if (cmp == 0)
+				j++;
+		} else {
+			if (cache->used[j])
+				out[n_out++] = cache->entries[j];
+			j++;
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	memcpy(header.magic, DIGEST_CACHE_MAGIC, sizeof(header.magic));
+	header.version = htole32(DIGEST_CACHE_VERSION);
+	header.entry_size = htole32(sizeof(struct digest_cache_entry));
+	header.n_entries = htole64(n_out);
+
+	tmp_path = str_join(cache->path, ".XXXXXX");
+	if (tmp_path == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	fd = mkostemp(tmp_path, O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	/* Flushed before the rename, so a crash can't leave an empty or
+	 * partial cache in place of the old one */
+	if (write_all(fd, &header, sizeof(header)) < 0 ||
+	    write_all(fd, out, n_out * sizeof(struct digest_cache_entry)) < 0 ||
+	    fchmod(fd, 0644) < 0 || fsync(fd) < 0 ||
+	    rename(tmp_path, cache->path) < 0) {
+		errsv = errno;
+		unlink(tmp_path);
+		errno = errsv;
+		return -1;
+	}
+
+	return 0;
+}
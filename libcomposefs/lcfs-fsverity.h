@@ -16,12 +16,21 @@
 
 #include <stdint.h>
 
-typedef struct FsVerityContext FsVerityContext;
+#include "lcfs-sha256.h"
+
+#define LCFS_FSVERITY_BLOCK_SIZE 4096
 
-#define LCFS_SHA256_DIGEST_LEN 32
+typedef struct FsVerityContext FsVerityContext;
 
 FsVerityContext *lcfs_fsverity_context_new(void);
 void lcfs_fsverity_context_free(FsVerityContext *ctx);
 void lcfs_fsverity_context_update(FsVerityContext *ctx, void *data, size_t data_len);
+void lcfs_fsverity_context_update_zeros(FsVerityContext *ctx, uint64_t data_len);
+void lcfs_fsverity_hash_blocks(FsVerityContext *ctx, const uint8_t *data,
+			       size_t n_blocks,
+			       uint8_t (*digests)[LCFS_SHA256_DIGEST_LEN]);
+void lcfs_fsverity_context_update_digests(FsVerityContext *ctx,
+					  uint8_t (*digests)[LCFS_SHA256_DIGEST_LEN],
+					  size_t n_blocks);
 void lcfs_fsverity_context_get_digest(FsVerityContext *ctx,
 				      uint8_t digest[LCFS_SHA256_DIGEST_LEN]);
@@ -0,0 +1,185 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "lcfs-intern.h"
+#include "hash.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The table is split in shards with their own lock, so parallel
+ * builds don't all serialize on a single lock */
+#define LCFS_INTERN_N_SHARDS 16
+
+struct lcfs_interned_s {
+	const char *data; /* Points to buf, or to the key data in lookups */
+	size_t len;
+	size_t hash;
+	size_t ref_count; /* Protected by the shard lock */
+	char buf[];
+};
+
+struct lcfs_intern_shard_s {
+	pthread_mutex_t lock;
+	Hash_table *table;
+};
+
+static struct lcfs_intern_shard_s shards[LCFS_INTERN_N_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static size_t interned_ht_hasher(const void *d, size_t n)
+{
+	const struct lcfs_interned_s *v = d;
+	return v->hash % n;
+}
+
+static bool interned_ht_comparator(const void *d1, const void *d2)
+{
+	const struct lcfs_interned_s *v1 = d1;
+	const struct lcfs_interned_s *v2 = d2;
+
+	return v1->hash == v2->hash && v1->len == v2->len &&
+	       memcmp(v1->data, v2->data, v1->len) == 0;
+}
+
+static void init_shards(void)
+{
+	for (size_t i = 0; i < LCFS_INTERN_N_SHARDS; i++)
+		pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+/* FNV-1a */
+static size_t intern_hash(const uint8_t *data, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return (size_t)(h ^ (h >> 32));
+}
+
+static struct lcfs_intern_shard_s *shard_for_hash(size_t hash)
+{
+	/* The low bits pick the hash table bucket, use others here */
+	return &shards[(hash >> 24) % LCFS_INTERN_N_SHARDS];
+}
+
+static struct lcfs_interned_s *interned_from_data(char *data)
+{
+	return (struct lcfs_interned_s *)(data - offsetof(struct lcfs_interned_s, buf));
+}
+
+char *lcfs_intern(const void *data, size_t len)
+{
+	struct lcfs_interned_s key;
+	struct lcfs_intern_shard_s *shard;
+	struct lcfs_interned_s *ent;
+
+	if (data == NULL)
+		data = "";
+
+	key.data = data;
+	key.len = len;
+	key.hash = intern_hash(data, len);
+
+	pthread_once(&shards_once, init_shards);
+	shard = shard_for_hash(key.hash);
+
+	pthread_mutex_lock(&shard->lock);
+
+	if (shard->table == NULL) {
+		shard->table = hash_initialize(0, NULL, interned_ht_hasher,
+					       interned_ht_comparator, NULL);
+		if (shard->table == NULL)
+			goto fail;
+	}
+
+	ent = hash_lookup(shard->table, &key);
+	if (ent == NULL) {
+		ent = malloc(sizeof(struct lcfs_interned_s) + len + 1);
+		if (ent == NULL)
+			goto fail;
+		memcpy(ent->buf, data, len);
+		ent->buf[len] = 0;
+		ent->data = ent->buf;
+		ent->len = len;
+		ent->hash = key.hash;
+		ent->ref_count = 0;
+
+		if (hash_insert(shard->table, ent) == NULL) {
+			free(ent);
+			goto fail;
+		}
+	}
+	ent->ref_count++;
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return ent->buf;
+
+fail:
+	pthread_mutex_unlock(&shard->lock);
+	errno = ENOMEM;
+	return NULL;
+}
+
+char *lcfs_intern_string(const char *str)
+{
+	return lcfs_intern(str, strlen(str));
+}
+
+char *lcfs_intern_ref(char *interned)
+{
+	struct lcfs_interned_s *ent = interned_from_data(interned);
+	struct lcfs_intern_shard_s *shard = shard_for_hash(ent->hash);
+
+	pthread_mutex_lock(&shard->lock);
+	ent->ref_count++;
+	pthread_mutex_unlock(&shard->lock);
+
+	return interned;
+}
+
+void lcfs_intern_unref(char *interned)
+{
+	struct lcfs_interned_s *ent;
+	struct lcfs_intern_shard_s *shard;
+
+	if (interned == NULL)
+		return;
+
+	ent = interned_from_data(interned);
+	shard = shard_for_hash(ent->hash);
+
+	pthread_mutex_lock(&shard->lock);
+	if (--ent->ref_count == 0) {
+		hash_remove(shard->table, ent);
+		free(ent);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
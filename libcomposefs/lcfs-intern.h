@@ -0,0 +1,35 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef _LCFS_INTERN_H
+#define _LCFS_INTERN_H
+
+#include <stddef.h>
+
+/* A process wide, thread safe table of reference counted strings.
+ *
+ * Interning the same bytes twice returns the same pointer, so
+ * interned strings can be compared by identity. The returned data
+ * is always zero terminated (not counted in len), and must not be
+ * modified.
+ */
+
+char *lcfs_intern(const void *data, size_t len);
+char *lcfs_intern_string(const char *str);
+char *lcfs_intern_ref(char *interned);
+void lcfs_intern_unref(char *interned);
+
+#endif
@@ -31,6 +31,8 @@
 
 #include "lcfs-writer.h"
 #include "lcfs-fsverity.h"
+#include "lcfs-arena.h"
+#include "lcfs-intern.h"
 #include "hash.h"
 
 /* When using LCFS_BUILD_INLINE_SMALL in lcfs_load_node_from_file() inline files below this size
@@ -70,6 +72,9 @@
 
 #define LCFS_MAX_NAME_LENGTH 255 /* max len of file name excluding NULL */
 
+/* Output is passed on in chunks of this size */
+#define LCFS_WRITE_BUFFER_SIZE (128 * 1024)
+
 #define lcfs_u16_to_file(v)                                                    \
 	({                                                                     \
 		_Static_assert(sizeof(v) == sizeof(uint16_t),                  \
@@ -115,6 +120,7 @@
 /* In memory representation used to build the file.  */
 
 struct lcfs_xattr_s {
+	/* Both interned, so equal keys or values have the same pointer */
 	char *key;
 	char *value;
 	uint16_t value_len;
@@ -129,18 +135,31 @@ struct lcfs_inode_s {
 	uint32_t st_uid; /* User ID of owner.  */
 	uint32_t st_gid; /* Group ID of owner.  */
 	uint32_t st_rdev; /* Device ID (if special file).  */
+	uint32_t st_mtim_nsec;
 	uint64_t st_size; /* Size of file, only used for regular files */
 	int64_t st_mtim_sec;
-	uint32_t st_mtim_nsec;
 };
 
+/* This is kept small, as there is one per inode. Anything only needed
+ * while writing a specific format is kept by the writer, indexed by
+ * inode_num, and optional data is stored out of line. */
 struct lcfs_node_s {
 	int ref_count;
 
+	/* Used during compute_tree */
+	uint32_t inode_num;
+
+	/* If set (owns a ref), the node itself and its name, payload,
+	 * content and digest are allocated from this */
+	lcfs_arena_t *arena;
+
 	struct lcfs_node_s *parent;
 
 	struct lcfs_node_s **children; /* Owns refs */
-	size_t children_size;
+
+	/* Lazily built hash index of children by name, for large
+	 * directories. Holds children indexes + 1, 0 is unused. */
+	uint32_t *children_index;
 
 	/* Used to create hard links.  */
 	struct lcfs_node_s *link_to; /* Owns refs */
@@ -151,24 +170,22 @@ struct lcfs_node_s {
 	uint8_t *content;
 
 	struct lcfs_xattr_s *xattrs;
-	size_t n_xattrs;
 
-	bool digest_set;
-	uint8_t digest[LCFS_DIGEST_SIZE]; /* sha256 fs-verity digest */
-
-	struct lcfs_inode_s inode;
+	uint8_t *digest; /* sha256 fs-verity digest, if set */
 
 	/* Used during compute_tree */
 	struct lcfs_node_s *next; /* Use for the queue in compute_tree */
+
+	uint32_t children_size;
+	uint32_t children_allocated;
+	uint32_t children_index_size; /* Power of two */
+	uint32_t n_xattrs;
+	uint32_t xattrs_allocated;
+
+	/* Used during compute_tree */
 	bool in_tree;
-	uint32_t inode_num;
 
-	bool erofs_compact;
-	uint32_t erofs_ipad; /* padding before inode data */
-	uint32_t erofs_isize;
-	uint64_t erofs_nid;
-	uint32_t erofs_n_blocks;
-	uint32_t erofs_tailsize;
+	struct lcfs_inode_s inode;
 };
 
 struct lcfs_ctx_s {
@@ -185,9 +202,19 @@ struct lcfs_ctx_s {
 
 	void *file;
 	lcfs_write_cb write_cb;
+	int fd; /* Used instead of write_cb if >= 0 */
 	off_t bytes_written;
 	FsVerityContext *fsverity_ctx;
 
+	/* Small writes are collected here, see lcfs_write() */
+	uint8_t *write_buf;
+	size_t write_buf_used;
+	size_t write_buf_hashed; /* Already passed to fsverity_ctx */
+
+	/* With LCFS_FLAGS_WRITE_MMAP, the whole image is written here */
+	uint8_t *map;
+	size_t map_size;
+
 	void (*finalize)(struct lcfs_ctx_s *ctx);
 };
 
@@ -203,8 +230,11 @@ static inline void lcfs_node_unrefp(struct lcfs_node_s **nodep)
 /* lcfs-writer.c */
 size_t hash_memory(const char *string, size_t len, size_t n_buckets);
 int lcfs_write(struct lcfs_ctx_s *ctx, void *_data, size_t data_len);
+int lcfs_write_flush(struct lcfs_ctx_s *ctx);
+int lcfs_write_set_size(struct lcfs_ctx_s *ctx, uint64_t size);
 int lcfs_write_align(struct lcfs_ctx_s *ctx, size_t align_size);
 int lcfs_write_pad(struct lcfs_ctx_s *ctx, size_t data_len);
+int lcfs_write_fill(struct lcfs_ctx_s *ctx, int c, size_t data_len);
 int lcfs_compute_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root);
 int lcfs_clone_root(struct lcfs_ctx_s *ctx);
 char *maybe_join_path(const char *a, const char *b);
@@ -0,0 +1,307 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "lcfs-pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct lcfs_pool_task_s {
+	lcfs_pool_func_t func;
+	void *data;
+};
+
+struct lcfs_pool_worker_s {
+	struct lcfs_pool_s *pool;
+	pthread_t thread;
+	bool started;
+
+	/* Circular deque, owner uses the tail, thieves use the head */
+	pthread_mutex_t lock;
+	struct lcfs_pool_task_s *tasks;
+	size_t head;
+	size_t n_tasks;
+	size_t allocated_tasks;
+};
+
+struct lcfs_pool_s {
+	struct lcfs_pool_worker_s *workers;
+	size_t n_workers;
+
+	atomic_size_t n_queued; /* Tasks in some deque */
+	atomic_size_t n_pending; /* Tasks queued or running */
+	atomic_size_t n_sleeping;
+	atomic_size_t next_worker;
+	bool shutdown;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+};
+
+static __thread struct lcfs_pool_worker_s *current_worker;
+
+static int worker_push_tail(struct lcfs_pool_worker_s *worker,
+			    struct lcfs_pool_task_s *task)
+{
+	pthread_mutex_lock(&worker->lock);
+
+	if (worker->n_tasks == worker->allocated_tasks) {
+		size_t new_allocated = worker->allocated_tasks == 0 ?
+					       64 :
+					       worker->allocated_tasks * 2;
+		struct lcfs_pool_task_s *new_tasks;
+
+		new_tasks = malloc(new_allocated * sizeof(struct lcfs_pool_task_s));
+		if (new_tasks == NULL) {
+			pthread_mutex_unlock(&worker->lock);
+			errno = ENOMEM;
+			return -1;
+		}
+
+		/* Unwrap the ring into the new array */
+		for (size_t i = 0; i < worker->n_tasks; i++)
+			new_tasks[i] = worker->tasks[(worker->head + i) %
+						     worker->allocated_tasks];
+
+		free(worker->tasks);
+		worker->tasks = new_tasks;
+		worker->head = 0;
+		worker->allocated_tasks = new_allocated;
+	}
+
+	worker->tasks[(worker->head + worker->n_tasks) % worker->allocated_tasks] =
+		*task;
+	worker->n_tasks++;
+
+	pthread_mutex_unlock(&worker->lock);
+	return 0;
+}
+
+static bool worker_pop_tail(struct lcfs_pool_worker_s *worker,
+			    struct lcfs_pool_task_s *task)
+{
+	bool res = false;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->n_tasks > 0) {
+		worker->n_tasks--;
+		*task = worker->tasks[(worker->head + worker->n_tasks) %
+				      worker->allocated_tasks];
+		res = true;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return res;
+}
+
+static bool worker_steal_head(struct lcfs_pool_worker_s *worker,
+			      struct lcfs_pool_task_s *task)
+{
+	bool res = false;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->n_tasks > 0) {
+		*task = worker->tasks[worker->head];
+		worker->head = (worker->head + 1) % worker->allocated_tasks;
+		worker->n_tasks--;
+		res = true;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return res;
+}
+
+static bool pool_get_task(struct lcfs_pool_worker_s *worker,
+			  struct lcfs_pool_task_s *task)
+{
+	struct lcfs_pool_s *pool = worker->pool;
+	size_t self = worker - pool->workers;
+
+	if (worker_pop_tail(worker, task))
+		return true;
+
+	for (size_t i = 1; i < pool->n_workers; i++) {
+		struct lcfs_pool_worker_s *victim =
+			&pool->workers[(self + i) % pool->n_workers];
+		if (worker_steal_head(victim, task))
+			return true;
+	}
+
+	return false;
+}
+
+static void *pool_worker_thread(void *data)
+{
+	struct lcfs_pool_worker_s *worker = data;
+	struct lcfs_pool_s *pool = worker->pool;
+	struct lcfs_pool_task_s task;
+
+	current_worker = worker;
+
+	for (;;) {
+		if (pool_get_task(worker, &task)) {
+			atomic_fetch_sub(&pool->n_queued, 1);
+
+			task.func(task.data);
+
+			if (atomic_fetch_sub(&pool->n_pending, 1) == 1) {
+				pthread_mutex_lock(&pool->lock);
+				pthread_cond_broadcast(&pool->done_cond);
+				pthread_mutex_unlock(&pool->lock);
+			}
+			continue;
+		}
+
+		/* Nothing to do, sleep until a new task is queued. Pushers
+		 * check n_sleeping after bumping n_queued, so we can't miss
+		 * a wakeup. */
+		pthread_mutex_lock(&pool->lock);
+		atomic_fetch_add(&pool->n_sleeping, 1);
+		while (atomic_load(&pool->n_queued) == 0 && !pool->shutdown)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		atomic_fetch_sub(&pool->n_sleeping, 1);
+		if (pool->shutdown) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	current_worker = NULL;
+	return NULL;
+}
+
+lcfs_pool_t *lcfs_pool_new(size_t n_threads)
+{
+	struct lcfs_pool_s *pool;
+	int r;
+
+	if (n_threads == 0)
+		n_threads = 1;
+
+	pool = calloc(1, sizeof(struct lcfs_pool_s));
+	if (pool == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pool->workers = calloc(n_threads, sizeof(struct lcfs_pool_worker_s));
+	if (pool->workers == NULL) {
+		free(pool);
+		errno = ENOMEM;
+		return NULL;
+	}
+	pool->n_workers = n_threads;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (size_t i = 0; i < n_threads; i++) {
+		struct lcfs_pool_worker_s *worker = &pool->workers[i];
+		worker->pool = pool;
+		pthread_mutex_init(&worker->lock, NULL);
+	}
+
+	for (size_t i = 0; i < n_threads; i++) {
+		struct lcfs_pool_worker_s *worker = &pool->workers[i];
+
+		r = pthread_create(&worker->thread, NULL, pool_worker_thread, worker);
+		if (r != 0) {
+			lcfs_pool_free(pool);
+			errno = r;
+			return NULL;
+		}
+		worker->started = true;
+	}
+
+	return pool;
+}
+
+/* May be called both from outside the pool and from within a running task */
+int lcfs_pool_push(lcfs_pool_t *pool, lcfs_pool_func_t func, void *data)
+{
+	struct lcfs_pool_task_s task = { func, data };
+	struct lcfs_pool_worker_s *worker;
+
+	if (current_worker != NULL && current_worker->pool == pool) {
+		worker = current_worker;
+	} else {
+		size_t next = atomic_fetch_add(&pool->next_worker, 1);
+		worker = &pool->workers[next % pool->n_workers];
+	}
+
+	atomic_fetch_add(&pool->n_pending, 1);
+
+	if (worker_push_tail(worker, &task) < 0) {
+		atomic_fetch_sub(&pool->n_pending, 1);
+		return -1;
+	}
+
+	atomic_fetch_add(&pool->n_queued, 1);
+
+	if (atomic_load(&pool->n_sleeping) > 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->work_cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return 0;
+}
+
+/* Wait for all pushed tasks, and all tasks they pushed, to finish */
+void lcfs_pool_wait(lcfs_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (atomic_load(&pool->n_pending) > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void lcfs_pool_free(lcfs_pool_t *pool)
+{
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (size_t i = 0; i < pool->n_workers; i++) {
+		struct lcfs_pool_worker_s *worker = &pool->workers[i];
+
+		if (worker->started)
+			pthread_join(worker->thread, NULL);
+		pthread_mutex_destroy(&worker->lock);
+		free(worker->tasks);
+	}
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
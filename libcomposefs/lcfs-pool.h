@@ -0,0 +1,39 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef _LCFS_POOL_H
+#define _LCFS_POOL_H
+
+#include <stddef.h>
+
+/* A simple work-stealing thread pool.
+ *
+ * Every worker has its own task deque. Tasks pushed from inside a
+ * worker go to the front of that workers deque and are popped LIFO
+ * (depth first), while idle workers steal from the back of other
+ * workers deques (oldest, and typically largest, tasks first).
+ */
+
+typedef struct lcfs_pool_s lcfs_pool_t;
+
+typedef void (*lcfs_pool_func_t)(void *data);
+
+lcfs_pool_t *lcfs_pool_new(size_t n_threads);
+int lcfs_pool_push(lcfs_pool_t *pool, lcfs_pool_func_t func, void *data);
+void lcfs_pool_wait(lcfs_pool_t *pool);
+void lcfs_pool_free(lcfs_pool_t *pool);
+
+#endif
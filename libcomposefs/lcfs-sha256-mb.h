@@ -0,0 +1,115 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* Multi-buffer SHA-256 kernel, hashing SHA256_MB_LANES independent
+ * pages of LCFS_SHA256_PAGE_SIZE bytes at once, one per vector lane.
+ *
+ * This is included from lcfs-sha256.c once per vector width, with
+ * SHA256_MB_LANES, SHA256_MB_VEC, SHA256_MB_FUNC and SHA256_MB_TARGET
+ * defined. The vector code is written with the gcc vector extensions,
+ * so the same source compiles to SSE2, NEON, AVX2 or AVX-512 depending
+ * on the target. */
+
+typedef uint32_t SHA256_MB_VEC __attribute__((vector_size(SHA256_MB_LANES * 4)));
+
+SHA256_MB_TARGET static void
+SHA256_MB_FUNC(const uint8_t *const *pages,
+	       uint8_t (*digests)[LCFS_SHA256_DIGEST_LEN])
+{
+	SHA256_MB_VEC state[8];
+
+	for (int i = 0; i < 8; i++)
+		state[i] = (SHA256_MB_VEC){ 0 } + sha256_init_state[i];
+
+	/* The last block is the (constant) padding */
+	for (int block = 0; block <= LCFS_SHA256_PAGE_SIZE / SHA256_DATASIZE; block++) {
+		uint32_t words[16][SHA256_MB_LANES]
+			__attribute__((aligned(sizeof(SHA256_MB_VEC))));
+		SHA256_MB_VEC w[16];
+		SHA256_MB_VEC a, b, c, d, e, f, g, h;
+
+		/* Transpose the big-endian message words into lanes */
+		for (int t = 0; t < 16; t++) {
+			for (int lane = 0; lane < SHA256_MB_LANES; lane++) {
+				const uint8_t *src;
+				uint32_t word;
+
+				if (block < LCFS_SHA256_PAGE_SIZE / SHA256_DATASIZE)
+					src = pages[lane] + block * SHA256_DATASIZE;
+				else
+					src = sha256_page_padding;
+				memcpy(&word, src + t * 4, sizeof(word));
+				words[t][lane] = be32toh(word);
+			}
+		}
+		memcpy(w, words, sizeof(w));
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+
+		for (int t = 0; t < 64; t++) {
+			SHA256_MB_VEC t1, t2;
+
+			if (t >= 16) {
+				SHA256_MB_VEC w2 = w[(t - 2) & 15];
+				SHA256_MB_VEC w15 = w[(t - 15) & 15];
+
+				w[t & 15] += (MB_ROTR(w2, 17) ^ MB_ROTR(w2, 19) ^
+					      (w2 >> 10)) +
+					     w[(t - 7) & 15] +
+					     (MB_ROTR(w15, 7) ^ MB_ROTR(w15, 18) ^
+					      (w15 >> 3));
+			}
+
+			t1 = h + (MB_ROTR(e, 6) ^ MB_ROTR(e, 11) ^ MB_ROTR(e, 25)) +
+			     (g ^ (e & (f ^ g))) + sha256_k[t] + w[t & 15];
+			t2 = (MB_ROTR(a, 2) ^ MB_ROTR(a, 13) ^ MB_ROTR(a, 22)) +
+			     ((a & b) | (c & (a | b)));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+
+	for (int lane = 0; lane < SHA256_MB_LANES; lane++)
+		for (int i = 0; i < 8; i++)
+			PUT_UINT32(state[i][lane], digests[lane], i * 4);
+}
+
+#undef SHA256_MB_LANES
+#undef SHA256_MB_VEC
+#undef SHA256_MB_FUNC
+#undef SHA256_MB_TARGET
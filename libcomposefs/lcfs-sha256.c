@@ -0,0 +1,736 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "lcfs-internal.h" /* for endian.h */
+#include "lcfs-sha256.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/param.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__)
+#define HAVE_SHA256_ARMV8 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#ifdef __clang__
+#define ARMV8_SHA2_TARGET __attribute__((target("crypto")))
+#else
+#define ARMV8_SHA2_TARGET __attribute__((target("+crypto")))
+#endif
+#endif
+
+#define SHA256_DATASIZE 64
+
+typedef void (*sha256_transform_func)(uint32_t state[8], const uint8_t *data,
+				      size_t n_blocks);
+
+struct sha256_backend {
+	const char *name;
+	bool accelerated;
+	bool (*supported)(void);
+	sha256_transform_func transform;
+};
+
+static const uint32_t sha256_init_state[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#if defined(HAVE_SHA256_X86) || defined(HAVE_SHA256_ARMV8)
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+#endif
+
+/* Portable implementation, adapted from the SHA256 implementation in
+ * glib, which is originally:
+ *
+ * Copyright (C) 2006 Dave Benson
+ * Released under the terms of the GNU Lesser General Public License
+ */
+
+#define GET_UINT32(n, b, i)                                                     \
+	do {                                                                    \
+		(n) = ((uint32_t)(b)[(i)] << 24) |                              \
+		      ((uint32_t)(b)[(i) + 1] << 16) |                          \
+		      ((uint32_t)(b)[(i) + 2] << 8) | ((uint32_t)(b)[(i) + 3]); \
+	} while (0)
+
+#define PUT_UINT32(n, b, i)                                                    \
+	do {                                                                   \
+		(b)[(i)] = (uint8_t)((n) >> 24);                               \
+		(b)[(i) + 1] = (uint8_t)((n) >> 16);                           \
+		(b)[(i) + 2] = (uint8_t)((n) >> 8);                            \
+		(b)[(i) + 3] = (uint8_t)((n));                                 \
+	} while (0)
+
+static inline __attribute__((always_inline)) void
+sha256_transform(uint32_t buf[8], uint8_t const data[64])
+{
+	uint32_t temp1, temp2, W[64];
+	uint32_t A, B, C, D, E, F, G, H;
+
+	GET_UINT32(W[0], data, 0);
+	GET_UINT32(W[1], data, 4);
+	GET_UINT32(W[2], data, 8);
+	GET_UINT32(W[3], data, 12);
+	GET_UINT32(W[4], data, 16);
+	GET_UINT32(W[5], data, 20);
+	GET_UINT32(W[6], data, 24);
+	GET_UINT32(W[7], data, 28);
+	GET_UINT32(W[8], data, 32);
+	GET_UINT32(W[9], data, 36);
+	GET_UINT32(W[10], data, 40);
+	GET_UINT32(W[11], data, 44);
+	GET_UINT32(W[12], data, 48);
+	GET_UINT32(W[13], data, 52);
+	GET_UINT32(W[14], data, 56);
+	GET_UINT32(W[15], data, 60);
+
+#define SHR(x, n) ((x & 0xFFFFFFFF) >> n)
+#define ROTR(x, n) (SHR(x, n) | (x << (32 - n)))
+
+#define S0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ SHR(x, 3))
+#define S1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ SHR(x, 10))
+#define S2(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define S3(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+
+#define F0(x, y, z) ((x & y) | (z & (x | y)))
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+
+#define R(t) (W[t] = S1(W[t - 2]) + W[t - 7] + S0(W[t - 15]) + W[t - 16])
+
+#define P(a, b, c, d, e, f, g, h, x, K)                                        \
+	do {                                                                   \
+		temp1 = h + S3(e) + F1(e, f, g) + K + x;                       \
+		temp2 = S2(a) + F0(a, b, c);                                   \
+		d += temp1;                                                    \
+		h = temp1 + temp2;                                             \
+	} while (0)
+
+	A = buf[0];
+	B = buf[1];
+	C = buf[2];
+	D = buf[3];
+	E = buf[4];
+	F = buf[5];
+	G = buf[6];
+	H = buf[7];
+
+	P(A, B, C, D, E, F, G, H, W[0], 0x428A2F98);
+	P(H, A, B, C, D, E, F, G, W[1], 0x71374491);
+	P(G, H, A, B, C, D, E, F, W[2], 0xB5C0FBCF);
+	P(F, G, H, A, B, C, D, E, W[3], 0xE9B5DBA5);
+	P(E, F, G, H, A, B, C, D, W[4], 0x3956C25B);
+	P(D, E, F, G, H, A, B, C, W[5], 0x59F111F1);
+	P(C, D, E, F, G, H, A, B, W[6], 0x923F82A4);
+	P(B, C, D, E, F, G, H, A, W[7], 0xAB1C5ED5);
+	P(A, B, C, D, E, F, G, H, W[8], 0xD807AA98);
+	P(H, A, B, C, D, E, F, G, W[9], 0x12835B01);
+	P(G, H, A, B, C, D, E, F, W[10], 0x243185BE);
+	P(F, G, H, A, B, C, D, E, W[11], 0x550C7DC3);
+	P(E, F, G, H, A, B, C, D, W[12], 0x72BE5D74);
+	P(D, E, F, G, H, A, B, C, W[13], 0x80DEB1FE);
+	P(C, D, E, F, G, H, A, B, W[14], 0x9BDC06A7);
+	P(B, C, D, E, F, G, H, A, W[15], 0xC19BF174);
+	P(A, B, C, D, E, F, G, H, R(16), 0xE49B69C1);
+	P(H, A, B, C, D, E, F, G, R(17), 0xEFBE4786);
+	P(G, H, A, B, C, D, E, F, R(18), 0x0FC19DC6);
+	P(F, G, H, A, B, C, D, E, R(19), 0x240CA1CC);
+	P(E, F, G, H, A, B, C, D, R(20), 0x2DE92C6F);
+	P(D, E, F, G, H, A, B, C, R(21), 0x4A7484AA);
+	P(C, D, E, F, G, H, A, B, R(22), 0x5CB0A9DC);
+	P(B, C, D, E, F, G, H, A, R(23), 0x76F988DA);
+	P(A, B, C, D, E, F, G, H, R(24), 0x983E5152);
+	P(H, A, B, C, D, E, F, G, R(25), 0xA831C66D);
+	P(G, H, A, B, C, D, E, F, R(26), 0xB00327C8);
+	P(F, G, H, A, B, C, D, E, R(27), 0xBF597FC7);
+	P(E, F, G, H, A, B, C, D, R(28), 0xC6E00BF3);
+	P(D, E, F, G, H, A, B, C, R(29), 0xD5A79147);
+	P(C, D, E, F, G, H, A, B, R(30), 0x06CA6351);
+	P(B, C, D, E, F, G, H, A, R(31), 0x14292967);
+	P(A, B, C, D, E, F, G, H, R(32), 0x27B70A85);
+	P(H, A, B, C, D, E, F, G, R(33), 0x2E1B2138);
+	P(G, H, A, B, C, D, E, F, R(34), 0x4D2C6DFC);
+	P(F, G, H, A, B, C, D, E, R(35), 0x53380D13);
+	P(E, F, G, H, A, B, C, D, R(36), 0x650A7354);
+	P(D, E, F, G, H, A, B, C, R(37), 0x766A0ABB);
+	P(C, D, E, F, G, H, A, B, R(38), 0x81C2C92E);
+	P(B, C, D, E, F, G, H, A, R(39), 0x92722C85);
+	P(A, B, C, D, E, F, G, H, R(40), 0xA2BFE8A1);
+	P(H, A, B, C, D, E, F, G, R(41), 0xA81A664B);
+	P(G, H, A, B, C, D, E, F, R(42), 0xC24B8B70);
+	P(F, G, H, A, B, C, D, E, R(43), 0xC76C51A3);
+	P(E, F, G, H, A, B, C, D, R(44), 0xD192E819);
+	P(D, E, F, G, H, A, B, C, R(45), 0xD6990624);
+	P(C, D, E, F, G, H, A, B, R(46), 0xF40E3585);
+	P(B, C, D, E, F, G, H, A, R(47), 0x106AA070);
+	P(A, B, C, D, E, F, G, H, R(48), 0x19A4C116);
+	P(H, A, B, C, D, E, F, G, R(49), 0x1E376C08);
+	P(G, H, A, B, C, D, E, F, R(50), 0x2748774C);
+	P(F, G, H, A, B, C, D, E, R(51), 0x34B0BCB5);
+	P(E, F, G, H, A, B, C, D, R(52), 0x391C0CB3);
+	P(D, E, F, G, H, A, B, C, R(53), 0x4ED8AA4A);
+	P(C, D, E, F, G, H, A, B, R(54), 0x5B9CCA4F);
+	P(B, C, D, E, F, G, H, A, R(55), 0x682E6FF3);
+	P(A, B, C, D, E, F, G, H, R(56), 0x748F82EE);
+	P(H, A, B, C, D, E, F, G, R(57), 0x78A5636F);
+	P(G, H, A, B, C, D, E, F, R(58), 0x84C87814);
+	P(F, G, H, A, B, C, D, E, R(59), 0x8CC70208);
+	P(E, F, G, H, A, B, C, D, R(60), 0x90BEFFFA);
+	P(D, E, F, G, H, A, B, C, R(61), 0xA4506CEB);
+	P(C, D, E, F, G, H, A, B, R(62), 0xBEF9A3F7);
+	P(B, C, D, E, F, G, H, A, R(63), 0xC67178F2);
+
+#undef SHR
+#undef ROTR
+#undef S0
+#undef S1
+#undef S2
+#undef S3
+#undef F0
+#undef F1
+#undef R
+#undef P
+
+	buf[0] += A;
+	buf[1] += B;
+	buf[2] += C;
+	buf[3] += D;
+	buf[4] += E;
+	buf[5] += F;
+	buf[6] += G;
+	buf[7] += H;
+}
+
+static void sha256_transform_generic(uint32_t state[8], const uint8_t *data,
+				     size_t n_blocks)
+{
+	while (n_blocks--) {
+		sha256_transform(state, data);
+		data += SHA256_DATASIZE;
+	}
+}
+
+static bool sha256_generic_supported(void)
+{
+	return true;
+}
+
+#ifdef HAVE_SHA256_X86
+
+/* The portable code, but compiled for BMI2 so the rotates become rorx
+ * and the choose function andn, which have no flag dependencies. This is
+ * still one block at a time, only the multi-buffer code uses vectors. */
+__attribute__((target("bmi2"))) static void
+sha256_transform_bmi2(uint32_t state[8], const uint8_t *data, size_t n_blocks)
+{
+	while (n_blocks--) {
+		sha256_transform(state, data);
+		data += SHA256_DATASIZE;
+	}
+}
+
+static bool sha256_bmi2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("bmi2");
+}
+
+/* Intel SHA extensions, based on the public domain code by Sean Gulley
+ * and Jeffrey Walton */
+__attribute__((target("sha,sse4.1,ssse3"))) static void
+sha256_transform_shani(uint32_t state[8], const uint8_t *data, size_t n_blocks)
+{
+	const __m128i byteswap =
+		_mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, tmp;
+
+	/* Reorder into the ABEF/CDGH layout sha256rnds2 uses */
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1); /* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1B); /* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8); /* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); /* CDGH */
+
+	while (n_blocks--) {
+		__m128i abef_save = state0;
+		__m128i cdgh_save = state1;
+		__m128i msg0, msg1, msg2, msg3, msg;
+
+		msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)),
+					byteswap);
+		msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)),
+					byteswap);
+		msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)),
+					byteswap);
+		msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)),
+					byteswap);
+
+		for (int i = 0; i < 16; i++) {
+			__m128i next = msg0;
+
+			/* Four rounds */
+			msg = _mm_add_epi32(msg0, _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+			/* Message schedule for the four rounds 16 rounds ahead */
+			if (i < 12) {
+				next = _mm_sha256msg1_epu32(msg0, msg1);
+				next = _mm_add_epi32(next, _mm_alignr_epi8(msg3, msg2, 4));
+				next = _mm_sha256msg2_epu32(next, msg3);
+			}
+
+			msg0 = msg1;
+			msg1 = msg2;
+			msg2 = msg3;
+			msg3 = next;
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += SHA256_DATASIZE;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B); /* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1); /* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0); /* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8); /* HGFE */
+
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+static bool sha256_shani_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	if ((ecx & bit_SSSE3) == 0 || (ecx & bit_SSE4_1) == 0)
+		return false;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return (ebx & bit_SHA) != 0;
+}
+
+#endif /* HAVE_SHA256_X86 */
+
+#ifdef HAVE_SHA256_ARMV8
+
+ARMV8_SHA2_TARGET static void sha256_transform_armv8(uint32_t state[8],
+						    const uint8_t *data,
+						    size_t n_blocks)
+{
+	uint32x4_t abcd = vld1q_u32(&state[0]);
+	uint32x4_t efgh = vld1q_u32(&state[4]);
+
+	while (n_blocks--) {
+		uint32x4_t abcd_save = abcd;
+		uint32x4_t efgh_save = efgh;
+		uint32x4_t msg0, msg1, msg2, msg3;
+
+		msg0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 0)));
+		msg1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+		msg2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+		msg3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+
+		for (int i = 0; i < 16; i++) {
+			uint32x4_t wk = vaddq_u32(msg0, vld1q_u32(&sha256_k[i * 4]));
+			uint32x4_t abcd_prev = abcd;
+			uint32x4_t next = msg0;
+
+			if (i < 12)
+				next = vsha256su1q_u32(vsha256su0q_u32(msg0, msg1),
+						       msg2, msg3);
+
+			abcd = vsha256hq_u32(abcd, efgh, wk);
+			efgh = vsha256h2q_u32(efgh, abcd_prev, wk);
+
+			msg0 = msg1;
+			msg1 = msg2;
+			msg2 = msg3;
+			msg3 = next;
+		}
+
+		abcd = vaddq_u32(abcd, abcd_save);
+		efgh = vaddq_u32(efgh, efgh_save);
+		data += SHA256_DATASIZE;
+	}
+
+	vst1q_u32(&state[0], abcd);
+	vst1q_u32(&state[4], efgh);
+}
+
+static bool sha256_armv8_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+
+#endif /* HAVE_SHA256_ARMV8 */
+
+/* The padding for a message of exactly LCFS_SHA256_PAGE_SIZE bytes is
+ * always the same block: 0x80, zeros, and the length in bits (0x8000) */
+static const uint8_t sha256_page_padding[SHA256_DATASIZE] = {
+	[0] = 0x80,
+	[SHA256_DATASIZE - 2] = (LCFS_SHA256_PAGE_SIZE * 8) >> 8,
+	[SHA256_DATASIZE - 1] = (LCFS_SHA256_PAGE_SIZE * 8) & 0xFF,
+};
+
+#if defined(HAVE_SHA256_X86) || defined(HAVE_SHA256_ARMV8)
+
+#define HAVE_SHA256_MB 1
+
+#define MB_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* Plain SSE2 or NEON, which are always available */
+#define SHA256_MB_LANES 4
+#define SHA256_MB_VEC sha256_vec4
+#define SHA256_MB_FUNC sha256_pages_x4
+#define SHA256_MB_TARGET
+#include "lcfs-sha256-mb.h"
+
+static bool sha256_x4_supported(void)
+{
+	return true;
+}
+
+#endif
+
+#ifdef HAVE_SHA256_X86
+
+#define SHA256_MB_LANES 8
+#define SHA256_MB_VEC sha256_vec8
+#define SHA256_MB_FUNC sha256_pages_avx2
+#define SHA256_MB_TARGET __attribute__((target("avx2")))
+#include "lcfs-sha256-mb.h"
+
+static bool sha256_pages_avx2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#define SHA256_MB_LANES 16
+#define SHA256_MB_VEC sha256_vec16
+#define SHA256_MB_FUNC sha256_pages_avx512
+#define SHA256_MB_TARGET __attribute__((target("avx512f")))
+#include "lcfs-sha256-mb.h"
+
+static bool sha256_pages_avx512_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+}
+
+#endif /* HAVE_SHA256_X86 */
+
+#ifdef HAVE_SHA256_MB
+
+struct sha256_mb_backend {
+	const char *name;
+	size_t n_lanes;
+	/* Faster than a single stream using SHA instructions */
+	bool beats_sha_instructions;
+	bool (*supported)(void);
+	void (*pages)(const uint8_t *const *pages,
+		      uint8_t (*digests)[LCFS_SHA256_DIGEST_LEN]);
+};
+
+/* In order of preference */
+static const struct sha256_mb_backend sha256_mb_backends[] = {
+#ifdef HAVE_SHA256_X86
+	{ "avx512-x16", 16, true, sha256_pages_avx512_supported, sha256_pages_avx512 },
+	{ "avx2-x8", 8, false, sha256_pages_avx2_supported, sha256_pages_avx2 },
+#endif
+	{ "simd-x4", 4, false, sha256_x4_supported, sha256_pages_x4 },
+};
+
+#define N_MB_BACKENDS (sizeof(sha256_mb_backends) / sizeof(sha256_mb_backends[0]))
+
+#else
+
+struct sha256_mb_backend {
+	const char *name;
+	size_t n_lanes;
+	void (*pages)(const uint8_t *const *pages,
+		      uint8_t (*digests)[LCFS_SHA256_DIGEST_LEN]);
+};
+
+#define N_MB_BACKENDS 0
+
+#endif /* HAVE_SHA256_MB */
+
+/* In order of preference */
+static const struct sha256_backend sha256_backends[] = {
+#ifdef HAVE_SHA256_X86
+	{ "sha-ni", true, sha256_shani_supported, sha256_transform_shani },
+	{ "bmi2", false, sha256_bmi2_supported, sha256_transform_bmi2 },
+#endif
+#ifdef HAVE_SHA256_ARMV8
+	{ "armv8", true, sha256_armv8_supported, sha256_transform_armv8 },
+#endif
+	{ "generic", false, sha256_generic_supported, sha256_transform_generic },
+};
+
+#define N_BACKENDS (sizeof(sha256_backends) / sizeof(sha256_backends[0]))
+
+static const struct sha256_backend *sha256_backend;
+static const char *sha256_supported_backends[N_BACKENDS + 1];
+static const struct sha256_mb_backend *sha256_mb_backend; /* May be NULL */
+static const char *sha256_supported_mb_backends[N_MB_BACKENDS + 1];
+static pthread_once_t sha256_backend_once = PTHREAD_ONCE_INIT;
+
+static void sha256_backend_init(void)
+{
+	size_t n_supported = 0;
+
+	for (size_t i = 0; i < N_BACKENDS; i++) {
+		const struct sha256_backend *backend = &sha256_backends[i];
+
+		if (!backend->supported())
+			continue;
+
+		if (sha256_backend == NULL)
+			sha256_backend = backend;
+		sha256_supported_backends[n_supported++] = backend->name;
+	}
+
+#ifdef HAVE_SHA256_MB
+	n_supported = 0;
+	for (size_t i = 0; i < N_MB_BACKENDS; i++) {
+		const struct sha256_mb_backend *backend = &sha256_mb_backends[i];
+
+		if (!backend->supported())
+			continue;
+
+		/* Only wide enough vectors beat the SHA instructions */
+		if (sha256_mb_backend == NULL &&
+		    (!sha256_backend->accelerated || backend->beats_sha_instructions))
+			sha256_mb_backend = backend;
+		sha256_supported_mb_backends[n_supported++] = backend->name;
+	}
+#endif
+}
+
+static const struct sha256_backend *get_backend(void)
+{
+	pthread_once(&sha256_backend_once, sha256_backend_init);
+	return sha256_backend;
+}
+
+static void sha256_state_to_digest(const uint32_t state[8],
+				   uint8_t digest[LCFS_SHA256_DIGEST_LEN])
+{
+	for (int i = 0; i < 8; i++)
+		PUT_UINT32(state[i], digest, i * 4);
+}
+
+void lcfs_sha256(const uint8_t *data, size_t data_len,
+		 uint8_t digest[LCFS_SHA256_DIGEST_LEN])
+{
+	const struct sha256_backend *backend = get_backend();
+	size_t n_blocks = data_len / SHA256_DATASIZE;
+	size_t rest = data_len % SHA256_DATASIZE;
+	uint8_t tail[2 * SHA256_DATASIZE] = { 0 };
+	size_t tail_len;
+	uint64_t n_bits = (uint64_t)data_len * 8;
+	uint32_t state[8];
+
+	memcpy(state, sha256_init_state, sizeof(state));
+
+	if (n_blocks > 0)
+		backend->transform(state, data, n_blocks);
+
+	memcpy(tail, data + n_blocks * SHA256_DATASIZE, rest);
+	tail[rest] = 0x80;
+	tail_len = rest < 56 ? SHA256_DATASIZE : 2 * SHA256_DATASIZE;
+	PUT_UINT32((uint32_t)(n_bits >> 32), tail, tail_len - 8);
+	PUT_UINT32((uint32_t)n_bits, tail, tail_len - 4);
+
+	backend->transform(state, tail, tail_len / SHA256_DATASIZE);
+
+	sha256_state_to_digest(state, digest);
+}
+
+void lcfs_sha256_page(const uint8_t data[LCFS_SHA256_PAGE_SIZE],
+		      uint8_t digest[LCFS_SHA256_DIGEST_LEN])
+{
+	const struct sha256_backend *backend = get_backend();
+	uint32_t state[8];
+
+	memcpy(state, sha256_init_state, sizeof(state));
+
+	backend->transform(state, data, LCFS_SHA256_PAGE_SIZE / SHA256_DATASIZE);
+	backend->transform(state, sha256_page_padding, 1);
+
+	sha256_state_to_digest(state, digest);
+}
+
+#define SHA256_MAX_LANES 16
+
+/* Hashes n_pages independent pages, using the multi-buffer code for
+ * as many as possible */
+void lcfs_sha256_pages(const uint8_t *const *pages, size_t n_pages,
+		       uint8_t (*digests)[LCFS_SHA256_DIGEST_LEN])
+{
+	const struct sha256_mb_backend *mb_backend;
+	size_t i = 0;
+
+	get_backend();
+	mb_backend = sha256_mb_backend;
+
+	if (mb_backend != NULL) {
+		for (; i + mb_backend->n_lanes <= n_pages; i += mb_backend->n_lanes)
+			mb_backend->pages(pages + i, digests + i);
+
+		/* Filling the unused lanes with copies is cheaper than
+		 * hashing more than half a batch one by one */
+		if (n_pages - i > mb_backend->n_lanes / 2) {
+			const uint8_t *batch[SHA256_MAX_LANES];
+			uint8_t batch_digests[SHA256_MAX_LANES][LCFS_SHA256_DIGEST_LEN];
+			size_t n_rest = n_pages - i;
+
+			for (size_t j = 0; j < mb_backend->n_lanes; j++)
+				batch[j] = pages[i + MIN(j, n_rest - 1)];
+			mb_backend->pages(batch, batch_digests);
+			memcpy(digests + i, batch_digests,
+			       n_rest * LCFS_SHA256_DIGEST_LEN);
+			i = n_pages;
+		}
+	}
+
+	for (; i < n_pages; i++)
+		lcfs_sha256_page(pages[i], digests[i]);
+}
+
+bool lcfs_sha256_is_accelerated(void)
+{
+	return get_backend()->accelerated;
+}
+
+bool lcfs_sha256_pages_is_accelerated(void)
+{
+	return get_backend()->accelerated || sha256_mb_backend != NULL;
+}
+
+const char *lcfs_sha256_get_backend(void)
+{
+	return get_backend()->name;
+}
+
+const char *const *lcfs_sha256_list_backends(void)
+{
+	get_backend();
+	return sha256_supported_backends;
+}
+
+const char *lcfs_sha256_get_mb_backend(void)
+{
+	get_backend();
+	return sha256_mb_backend ? sha256_mb_backend->name : NULL;
+}
+
+const char *const *lcfs_sha256_list_mb_backends(void)
+{
+	get_backend();
+	return sha256_supported_mb_backends;
+}
+
+/* Not thread-safe, only call this before hashing anything. A NULL
+ * name disables the multi-buffer code. */
+int lcfs_sha256_set_mb_backend(const char *name)
+{
+	get_backend();
+
+	if (name == NULL) {
+		sha256_mb_backend = NULL;
+		return 0;
+	}
+
+#ifdef HAVE_SHA256_MB
+	for (size_t i = 0; i < N_MB_BACKENDS; i++) {
+		const struct sha256_mb_backend *backend = &sha256_mb_backends[i];
+
+		if (strcmp(backend->name, name) != 0)
+			continue;
+
+		if (!backend->supported()) {
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		sha256_mb_backend = backend;
+		return 0;
+	}
+#endif
+
+	errno = ENOENT;
+	return -1;
+}
+
+/* Not thread-safe, only call this before hashing anything */
+int lcfs_sha256_set_backend(const char *name)
+{
+	get_backend();
+
+	for (size_t i = 0; i < N_BACKENDS; i++) {
+		const struct sha256_backend *backend = &sha256_backends[i];
+
+		if (strcmp(backend->name, name) != 0)
+			continue;
+
+		if (!backend->supported()) {
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		sha256_backend = backend;
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
@@ -0,0 +1,61 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef _LCFS_SHA256_H
+#define _LCFS_SHA256_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LCFS_SHA256_DIGEST_LEN 32
+#define LCFS_SHA256_PAGE_SIZE 4096
+
+/* Native SHA-256 implementation.
+ *
+ * The block transform is picked at runtime from the available
+ * backends (x86 SHA extensions, AVX2/BMI2, ARMv8 crypto extensions or
+ * portable C). "accelerated" means a backend that uses dedicated
+ * SHA-256 instructions, which is expected to beat any library.
+ *
+ * For hashing many pages there are also multi-buffer backends, which
+ * hash one page per SIMD vector lane.
+ */
+
+void lcfs_sha256(const uint8_t *data, size_t data_len,
+		 uint8_t digest[LCFS_SHA256_DIGEST_LEN]);
+
+/* Fast path for exactly LCFS_SHA256_PAGE_SIZE bytes, i.e. one fs-verity block */
+void lcfs_sha256_page(const uint8_t data[LCFS_SHA256_PAGE_SIZE],
+		      uint8_t digest[LCFS_SHA256_DIGEST_LEN]);
+
+/* Hashes n_pages separate pages, several at a time when multi-buffer
+ * (one page per SIMD lane) hashing is available */
+void lcfs_sha256_pages(const uint8_t *const *pages, size_t n_pages,
+		       uint8_t (*digests)[LCFS_SHA256_DIGEST_LEN]);
+
+bool lcfs_sha256_is_accelerated(void);
+bool lcfs_sha256_pages_is_accelerated(void);
+
+/* For testing and benchmarks */
+const char *lcfs_sha256_get_backend(void);
+const char *const *lcfs_sha256_list_backends(void);
+int lcfs_sha256_set_backend(const char *name);
+const char *lcfs_sha256_get_mb_backend(void);
+const char *const *lcfs_sha256_list_mb_backends(void);
+int lcfs_sha256_set_mb_backend(const char *name);
+
+#endif
@@ -0,0 +1,340 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "lcfs-uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+struct lcfs_uring_s {
+	int fd;
+
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map; /* May be the same as sq_map */
+	size_t cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_tail_local; /* Includes prepared requests */
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned int n_queued; /* Prepared, but not submitted */
+	unsigned int n_in_flight; /* Prepared, but not reaped */
+	unsigned int max_in_flight;
+};
+
+static int syscall_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int syscall_io_uring_enter(int fd, unsigned int to_submit,
+				  unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, NULL, 0);
+}
+
+static int syscall_io_uring_register(int fd, unsigned int opcode, void *arg,
+				     unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool lcfs_uring_supports_ops(int fd)
+{
+	static const int ops[] = { IORING_OP_STATX, IORING_OP_OPENAT,
+				   IORING_OP_READ, IORING_OP_CLOSE };
+	struct io_uring_probe *probe;
+	size_t n_probe_ops = 256;
+	bool res = true;
+
+	probe = calloc(1, sizeof(struct io_uring_probe) +
+				  n_probe_ops * sizeof(struct io_uring_probe_op));
+	if (probe == NULL)
+		return false;
+
+	if (syscall_io_uring_register(fd, IORING_REGISTER_PROBE, probe,
+				      n_probe_ops) < 0) {
+		free(probe);
+		return false;
+	}
+
+	for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (ops[i] > probe->last_op ||
+		    (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+			res = false;
+	}
+
+	free(probe);
+	return res;
+}
+
+void lcfs_uring_free(lcfs_uring_t *ring)
+{
+	if (ring == NULL)
+		return;
+
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+	if (ring->sq_map != NULL)
+		munmap(ring->sq_map, ring->sq_map_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring);
+}
+
+static void *lcfs_uring_map(int fd, size_t size, off_t offset)
+{
+	void *map;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   fd, offset);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	return map;
+}
+
+lcfs_uring_t *lcfs_uring_new(unsigned int entries)
+{
+	struct io_uring_params p = { 0 };
+	lcfs_uring_t *ring;
+	int errsv;
+
+	ring = calloc(1, sizeof(struct lcfs_uring_s));
+	if (ring == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ring->fd = syscall_io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		errsv = errno;
+		free(ring);
+		errno = errsv;
+		return NULL;
+	}
+
+	if (!lcfs_uring_supports_ops(ring->fd)) {
+		lcfs_uring_free(ring);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_map_size = MAX(ring->sq_map_size, ring->cq_map_size);
+		ring->cq_map_size = ring->sq_map_size;
+	}
+
+	ring->sq_map = lcfs_uring_map(ring->fd, ring->sq_map_size, IORING_OFF_SQ_RING);
+	if (ring->sq_map == NULL)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = lcfs_uring_map(ring->fd, ring->cq_map_size,
+					      IORING_OFF_CQ_RING);
+		if (ring->cq_map == NULL)
+			goto fail;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = lcfs_uring_map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+	if (ring->sqes == NULL)
+		goto fail;
+
+	ring->sq_head = (unsigned int *)((uint8_t *)ring->sq_map + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((uint8_t *)ring->sq_map + p.sq_off.tail);
+	ring->sq_array = (unsigned int *)((uint8_t *)ring->sq_map + p.sq_off.array);
+	ring->sq_mask = *(unsigned int *)((uint8_t *)ring->sq_map + p.sq_off.ring_mask);
+	ring->sq_tail_local = *ring->sq_tail;
+
+	ring->cq_head = (unsigned int *)((uint8_t *)ring->cq_map + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((uint8_t *)ring->cq_map + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)((uint8_t *)ring->cq_map + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cq_map + p.cq_off.cqes);
+
+	/* Never more requests than fit in either queue, so the submission
+	 * queue always has room and completions can't be dropped */
+	ring->max_in_flight = MIN(p.sq_entries, p.cq_entries);
+
+	return ring;
+
+fail:
+	errsv = errno;
+	lcfs_uring_free(ring);
+	errno = errsv;
+	return NULL;
+}
+
+static struct io_uring_sqe *lcfs_uring_get_sqe(lcfs_uring_t *ring,
+					       uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int index;
+
+	if (ring->n_in_flight >= ring->max_in_flight) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	index = ring->sq_tail_local & ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+
+	ring->sq_tail_local++;
+	ring->n_queued++;
+	ring->n_in_flight++;
+
+	return sqe;
+}
+
+int lcfs_uring_prep_statx(lcfs_uring_t *ring, int dirfd, const char *path,
+			  int flags, unsigned int mask, struct statx *buf,
+			  uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = lcfs_uring_get_sqe(ring, user_data);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = mask;
+	sqe->off = (uintptr_t)buf;
+	sqe->statx_flags = flags;
+
+	return 0;
+}
+
+int lcfs_uring_prep_openat(lcfs_uring_t *ring, int dirfd, const char *path,
+			   int flags, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = lcfs_uring_get_sqe(ring, user_data);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)path;
+	sqe->open_flags = flags;
+
+	return 0;
+}
+
+int lcfs_uring_prep_read(lcfs_uring_t *ring, int fd, void *buf, size_t count,
+			 uint64_t offset, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = lcfs_uring_get_sqe(ring, user_data);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = count;
+	sqe->off = offset;
+
+	return 0;
+}
+
+int lcfs_uring_prep_close(lcfs_uring_t *ring, int fd, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = lcfs_uring_get_sqe(ring, user_data);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+
+	return 0;
+}
+
+unsigned int lcfs_uring_get_in_flight(lcfs_uring_t *ring)
+{
+	return ring->n_in_flight;
+}
+
+/* Submits the prepared requests, and waits for at least wait_nr
+ * completions (which must be in flight) */
+int lcfs_uring_submit(lcfs_uring_t *ring, unsigned int wait_nr)
+{
+	int r;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_tail_local, __ATOMIC_RELEASE);
+
+	do
+		r = syscall_io_uring_enter(ring->fd, ring->n_queued, wait_nr,
+					   wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+	while (r < 0 && errno == EINTR);
+	if (r < 0)
+		return -1;
+
+	ring->n_queued -= r;
+	return 0;
+}
+
+bool lcfs_uring_get_completion(lcfs_uring_t *ring, uint64_t *user_data,
+			       int32_t *res)
+{
+	unsigned int head = *ring->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+
+	cqe = &ring->cqes[head & ring->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	ring->n_in_flight--;
+
+	return true;
+}
+
+#endif
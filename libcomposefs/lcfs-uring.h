@@ -0,0 +1,58 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This file is free software: you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 2.1 of the
+   License, or (at your option) any later version.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef _LCFS_URING_H
+#define _LCFS_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A minimal io_uring wrapper, using the raw syscalls.
+ *
+ * The prep functions queue a request, and fail with EBUSY if the ring
+ * is full (counting requests that are submitted but not yet reaped,
+ * so the completion queue can never overflow). Queued requests are
+ * passed to the kernel by lcfs_uring_submit(), and their results are
+ * reaped with lcfs_uring_get_completion().
+ *
+ * lcfs_uring_new() fails with ENOSYS if any of the used operations is
+ * not supported. Only available if HAVE_IO_URING is defined.
+ */
+
+typedef struct lcfs_uring_s lcfs_uring_t;
+
+struct statx;
+
+lcfs_uring_t *lcfs_uring_new(unsigned int entries);
+void lcfs_uring_free(lcfs_uring_t *ring);
+
+int lcfs_uring_prep_statx(lcfs_uring_t *ring, int dirfd, const char *path,
+			  int flags, unsigned int mask, struct statx *buf,
+			  uint64_t user_data);
+int lcfs_uring_prep_openat(lcfs_uring_t *ring, int dirfd, const char *path,
+			   int flags, uint64_t user_data);
+int lcfs_uring_prep_read(lcfs_uring_t *ring, int fd, void *buf, size_t count,
+			 uint64_t offset, uint64_t user_data);
+int lcfs_uring_prep_close(lcfs_uring_t *ring, int fd, uint64_t user_data);
+
+unsigned int lcfs_uring_get_in_flight(lcfs_uring_t *ring);
+int lcfs_uring_submit(lcfs_uring_t *ring, unsigned int wait_nr);
+bool lcfs_uring_get_completion(lcfs_uring_t *ring, uint64_t *user_data,
+			       int32_t *res);
+
+#endif
@@ -23,6 +23,7 @@
 #include "lcfs-writer.h"
 #include "lcfs-fsverity.h"
 #include "lcfs-erofs-internal.h"
+#include "lcfs-pool.h"
 #include "lcfs-utils.h"
 #include "hash.h"
 
@@ -157,13 +158,27 @@ static uint32_t xxh32(const void *input, const size_t len, const uint32_t seed)
 	return h32;
 }
 
+/* Layout of an inode in the image */
+struct lcfs_erofs_inode_s {
+	uint64_t nid;
+	uint32_t ipad; /* padding before inode data */
+	uint32_t isize;
+	uint32_t n_blocks;
+	uint32_t tailsize;
+	uint32_t blkaddr; /* First data block, relative to data_block_start */
+	bool compact;
+};
+
 struct lcfs_ctx_erofs_s {
 	struct lcfs_ctx_s base;
 
+	struct lcfs_erofs_inode_s *inodes; /* Indexed by inode_num */
+
+	uint64_t meta_start;
 	uint64_t inodes_end; /* start of xattrs */
 	uint64_t shared_xattr_size;
 	uint64_t n_data_blocks;
-	uint64_t current_end;
+	uint64_t data_block_start;
 	struct lcfs_xattr_s **shared_xattrs;
 	size_t n_shared_xattrs;
 };
@@ -172,9 +187,18 @@ static void lcfs_ctx_erofs_finalize(struct lcfs_ctx_s *ctx)
 {
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
 
+	free(ctx_erofs->inodes);
 	free(ctx_erofs->shared_xattrs);
 }
 
+static struct lcfs_erofs_inode_s *get_erofs_inode(struct lcfs_ctx_s *ctx,
+					      struct lcfs_node_s *node)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+
+	return &ctx_erofs->inodes[node->inode_num];
+}
+
 struct lcfs_ctx_s *lcfs_ctx_erofs_new(void)
 {
 	struct lcfs_ctx_erofs_s *ret = calloc(1, sizeof(struct lcfs_ctx_erofs_s));
@@ -217,12 +241,13 @@ struct hasher_xattr_s {
 	uint64_t shared_offset; /* offset in bytes from start of shared xattrs */
 };
 
+/* Keys and values are interned, so compare them by identity */
 static size_t xattrs_ht_hasher(const void *d, size_t n)
 {
 	const struct hasher_xattr_s *v = d;
-	return (hash_string(v->xattr->key, n) ^
-		hash_memory(v->xattr->value, v->xattr->value_len, n)) %
-	       n;
+	uintptr_t h = (uintptr_t)v->xattr->key * 31 + (uintptr_t)v->xattr->value;
+
+	return (h ^ (h >> 17)) % n;
 }
 
 static bool xattrs_ht_comparator(const void *d1, const void *d2)
@@ -230,13 +255,8 @@ static bool xattrs_ht_comparator(const void *d1, const void *d2)
 	const struct hasher_xattr_s *v1 = d1;
 	const struct hasher_xattr_s *v2 = d2;
 
-	if (strcmp(v1->xattr->key, v2->xattr->key) != 0)
-		return false;
-
-	if (v1->xattr->value_len != v2->xattr->value_len)
-		return false;
-
-	return memcmp(v1->xattr->value, v2->xattr->value, v1->xattr->value_len) == 0;
+	return v1->xattr->key == v2->xattr->key &&
+	       v1->xattr->value == v2->xattr->value;
 }
 
 /* Sort alphabetically by key and value to get some canonical order */
@@ -422,7 +442,8 @@ fail:
 }
 
 static bool lcfs_fits_in_erofs_compact(struct lcfs_ctx_s *ctx,
-				       struct lcfs_node_s *node)
+				       struct lcfs_node_s *node,
+				       struct lcfs_erofs_inode_s *ei)
 {
 	int type = node->inode.st_mode & S_IFMT;
 	uint64_t size;
@@ -438,8 +459,8 @@ static bool lcfs_fits_in_erofs_compact(struct lcfs_ctx_s *ctx,
 	}
 
 	if (type == S_IFDIR) {
-		size = (uint64_t)node->erofs_n_blocks * EROFS_BLKSIZ +
-		       node->erofs_tailsize;
+		size = (uint64_t)ei->n_blocks * EROFS_BLKSIZ +
+		       ei->tailsize;
 	} else {
 		size = node->inode.st_size;
 	}
@@ -450,7 +471,8 @@ static bool lcfs_fits_in_erofs_compact(struct lcfs_ctx_s *ctx,
 	return true;
 }
 
-static void compute_erofs_dir_size(struct lcfs_node_s *node)
+static void compute_erofs_dir_size(struct lcfs_node_s *node,
+				   struct lcfs_erofs_inode_s *ei)
 {
 	uint32_t n_blocks = 0;
 	size_t block_size = 0;
@@ -471,8 +493,8 @@ static void compute_erofs_dir_size(struct lcfs_node_s *node)
 		block_size = 0;
 	}
 
-	node->erofs_n_blocks = n_blocks;
-	node->erofs_tailsize = block_size;
+	ei->n_blocks = n_blocks;
+	ei->tailsize = block_size;
 }
 
 static uint32_t compute_erofs_chunk_bitsize(struct lcfs_node_s *node)
@@ -495,35 +517,36 @@ static uint32_t compute_erofs_chunk_bitsize(struct lcfs_node_s *node)
 	return chunkbits;
 }
 
-static void compute_erofs_inode_size(struct lcfs_node_s *node)
+static void compute_erofs_inode_size(struct lcfs_node_s *node,
+				     struct lcfs_erofs_inode_s *ei)
 {
 	int type = node->inode.st_mode & S_IFMT;
 	uint64_t file_size = node->inode.st_size;
 
 	if (type == S_IFDIR) {
-		compute_erofs_dir_size(node);
+		compute_erofs_dir_size(node, ei);
 	} else if (type == S_IFLNK) {
-		node->erofs_n_blocks = 0;
-		node->erofs_tailsize = strlen(node->payload);
+		ei->n_blocks = 0;
+		ei->tailsize = strlen(node->payload);
 	} else if (type == S_IFREG && file_size > 0) {
 		if (node->content != NULL) {
-			node->erofs_n_blocks = file_size / EROFS_BLKSIZ;
-			node->erofs_tailsize = file_size % EROFS_BLKSIZ;
-			if (node->erofs_tailsize > EROFS_BLKSIZ / 2) {
-				node->erofs_n_blocks++;
-				node->erofs_tailsize = 0;
+			ei->n_blocks = file_size / EROFS_BLKSIZ;
+			ei->tailsize = file_size % EROFS_BLKSIZ;
+			if (ei->tailsize > EROFS_BLKSIZ / 2) {
+				ei->n_blocks++;
+				ei->tailsize = 0;
 			}
 		} else {
 			uint32_t chunkbits = compute_erofs_chunk_bitsize(node);
 			uint64_t chunksize = 1ULL << chunkbits;
 			uint32_t chunk_count = DIV_ROUND_UP(file_size, chunksize);
 
-			node->erofs_n_blocks = 0;
-			node->erofs_tailsize = chunk_count * sizeof(uint32_t);
+			ei->n_blocks = 0;
+			ei->tailsize = chunk_count * sizeof(uint32_t);
 		}
 	} else {
-		node->erofs_n_blocks = 0;
-		node->erofs_tailsize = 0;
+		ei->n_blocks = 0;
+		ei->tailsize = 0;
 	}
 }
 
@@ -568,13 +591,14 @@ static uint32_t compute_erofs_xattr_filter(struct lcfs_node_s *node)
 }
 
 static uint64_t compute_erofs_inode_padding_for_tail(struct lcfs_node_s *node,
+						     struct lcfs_erofs_inode_s *ei,
 						     uint64_t pos, size_t inode_size,
 						     size_t xattr_size)
 {
 	int type = node->inode.st_mode & S_IFMT;
 	uint64_t block_remainder;
 	size_t non_tail_size = inode_size + xattr_size;
-	size_t total_size = inode_size + xattr_size + node->erofs_tailsize;
+	size_t total_size = inode_size + xattr_size + ei->tailsize;
 
 	/* This adds extra padding in front of an inode to ensure that
 	 * the tail data doesn't cross a block boundary.
@@ -593,20 +617,20 @@ static uint64_t compute_erofs_inode_padding_for_tail(struct lcfs_node_s *node,
 	}
 
 	block_remainder = EROFS_BLKSIZ - ((pos + non_tail_size) % EROFS_BLKSIZ);
-	if (block_remainder < node->erofs_tailsize) {
+	if (block_remainder < ei->tailsize) {
 		/* Add (aligned) padding so that tail starts in new block */
 		uint64_t extra_pad = round_up(block_remainder, EROFS_SLOTSIZE);
 
 		/* Due to the extra_pad round up it is possible the tail does not fit anyway */
 		block_remainder = EROFS_BLKSIZ -
 				  ((pos + non_tail_size + extra_pad) % EROFS_BLKSIZ);
-		if (node->erofs_tailsize <= block_remainder) {
+		if (ei->tailsize <= block_remainder) {
 			/* It fit! */
 			return extra_pad;
 		}
 		/* Didn't fit, don't inline the tail. */
-		node->erofs_n_blocks++;
-		node->erofs_tailsize = 0;
+		ei->n_blocks++;
+		ei->tailsize = 0;
 	}
 
 	return 0;
@@ -624,14 +648,23 @@ static int compute_erofs_inodes(struct lcfs_ctx_s *ctx)
 
 	// But inode offsets (nids) are relative to start of block
 	meta_start = round_down(pos, EROFS_BLKSIZ);
+	ctx_erofs->meta_start = meta_start;
+
+	ctx_erofs->inodes =
+		calloc(ctx->num_inodes, sizeof(struct lcfs_erofs_inode_s));
+	if (ctx_erofs->inodes == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
 
 	for (node = ctx->root; node != NULL; node = node->next) {
+		struct lcfs_erofs_inode_s *ei = get_erofs_inode(ctx, node);
 		size_t n_shared_xattrs, unshared_xattrs_size;
 		size_t inode_size, xattr_size;
 
-		compute_erofs_inode_size(node);
-		node->erofs_compact = lcfs_fits_in_erofs_compact(ctx, node);
-		inode_size = node->erofs_compact ?
+		compute_erofs_inode_size(node, ei);
+		ei->compact = lcfs_fits_in_erofs_compact(ctx, node, ei);
+		inode_size = ei->compact ?
 				     sizeof(struct erofs_inode_compact) :
 				     sizeof(struct erofs_inode_extended);
 
@@ -643,24 +676,25 @@ static int compute_erofs_inodes(struct lcfs_ctx_s *ctx)
 		/* Align inode start to next slot */
 		ppos = pos;
 		pos = round_up(pos, EROFS_SLOTSIZE);
-		node->erofs_ipad = pos - ppos;
+		ei->ipad = pos - ppos;
 
 		/* Ensure tail does not straddle block boundaries */
 		extra_pad = compute_erofs_inode_padding_for_tail(
-			node, pos, inode_size, xattr_size);
-		node->erofs_ipad += extra_pad;
+			node, ei, pos, inode_size, xattr_size);
+		ei->ipad += extra_pad;
 		pos += extra_pad;
 
-		node->erofs_isize = inode_size + xattr_size + node->erofs_tailsize;
-		ctx_erofs->n_data_blocks += node->erofs_n_blocks;
-		node->erofs_nid = (pos - meta_start) / EROFS_SLOTSIZE;
+		ei->isize = inode_size + xattr_size + ei->tailsize;
+		ei->blkaddr = ctx_erofs->n_data_blocks;
+		ctx_erofs->n_data_blocks += ei->n_blocks;
+		ei->nid = (pos - meta_start) / EROFS_SLOTSIZE;
 
 		/* Assert that tails never span multiple blocks */
-		assert(node->erofs_tailsize == 0 ||
+		assert(ei->tailsize == 0 ||
 		       ((pos + inode_size + xattr_size) / EROFS_BLKSIZ) ==
-			       ((pos + node->erofs_isize - 1) / EROFS_BLKSIZ));
+			       ((pos + ei->isize - 1) / EROFS_BLKSIZ));
 
-		pos += node->erofs_isize;
+		pos += ei->isize;
 	}
 
 	ctx_erofs->inodes_end = round_up(pos, EROFS_SLOTSIZE);
@@ -706,7 +740,7 @@ static int write_erofs_dentries_chunk(struct lcfs_ctx_s *ctx,
 		struct lcfs_node_s *target_child = follow_links(dirent_child);
 
 		struct erofs_dirent dirent = { 0 };
-		dirent.nid = lcfs_u64_to_file(target_child->erofs_nid);
+		dirent.nid = lcfs_u64_to_file(get_erofs_inode(ctx, target_child)->nid);
 		dirent.nameoff = lcfs_u16_to_file(nameoff);
 		dirent.file_type =
 			erofs_make_file_type(node_get_dtype(target_child));
@@ -732,6 +766,7 @@ static int write_erofs_dentries_chunk(struct lcfs_ctx_s *ctx,
 static int write_erofs_dentries(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node,
 				bool write_blocks, bool write_tail)
 {
+	struct lcfs_erofs_inode_s *ei = get_erofs_inode(ctx, node);
 	size_t block_size = 0;
 	size_t block_written = 0;
 	size_t first = 0;
@@ -757,7 +792,7 @@ static int write_erofs_dentries(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node
 
 	/* Handle the remaining block which is either tailpacked or block as decided before */
 
-	if (block_written < node->erofs_n_blocks) {
+	if (block_written < ei->n_blocks) {
 		if (write_blocks) {
 			ret = write_erofs_dentries_chunk(ctx, node, first,
 							 node->children_size - first,
@@ -784,6 +819,7 @@ static int write_erofs_dentries(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node
 static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node)
 {
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	struct lcfs_erofs_inode_s *ei = get_erofs_inode(ctx, node);
 	int type = node->inode.st_mode & S_IFMT;
 	size_t xattr_icount;
 	uint64_t size;
@@ -797,8 +833,9 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 	size_t xattr_size;
 	uint32_t chunk_count = 0;
 	uint16_t chunk_format = 0;
+	uint32_t blkaddr;
 
-	ret = lcfs_write_pad(ctx, node->erofs_ipad);
+	ret = lcfs_write_pad(ctx, ei->ipad);
 	if (ret < 0)
 		return ret;
 
@@ -813,13 +850,13 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 	if (xattr_icount > UINT16_MAX)
 		return -EINVAL;
 
-	version = node->erofs_compact ? 0 : 1;
-	datalayout = (node->erofs_tailsize > 0) ? EROFS_INODE_FLAT_INLINE :
+	version = ei->compact ? 0 : 1;
+	datalayout = (ei->tailsize > 0) ? EROFS_INODE_FLAT_INLINE :
 						  EROFS_INODE_FLAT_PLAIN;
 
 	if (type == S_IFDIR || type == S_IFLNK) {
-		size = (uint64_t)node->erofs_n_blocks * EROFS_BLKSIZ +
-		       node->erofs_tailsize;
+		size = (uint64_t)ei->n_blocks * EROFS_BLKSIZ +
+		       ei->tailsize;
 	} else if (type == S_IFREG) {
 		size = node->inode.st_size;
 
@@ -837,7 +874,9 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 
 	format = datalayout << EROFS_I_DATALAYOUT_BIT | version << EROFS_I_VERSION_BIT;
 
-	if (node->erofs_compact) {
+	blkaddr = (uint32_t)(ctx_erofs->data_block_start / EROFS_BLKSIZ) + ei->blkaddr;
+
+	if (ei->compact) {
 		struct erofs_inode_compact i = { 0 };
 		i.i_format = lcfs_u16_to_file(format);
 		i.i_xattr_icount = lcfs_u16_to_file((uint16_t)xattr_icount);
@@ -849,23 +888,13 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 		i.i_gid = lcfs_u16_to_file((uint16_t)node->inode.st_gid);
 
 		if (type == S_IFDIR) {
-			if (node->erofs_n_blocks > 0) {
-				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
-			}
+			if (ei->n_blocks > 0)
+				i.i_u.raw_blkaddr = lcfs_u32_to_file(blkaddr);
 		} else if (type == S_IFCHR || type == S_IFBLK) {
 			i.i_u.rdev = lcfs_u32_to_file(node->inode.st_rdev);
 		} else if (type == S_IFREG) {
-			if (node->erofs_n_blocks > 0) {
-				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
-			}
+			if (ei->n_blocks > 0)
+				i.i_u.raw_blkaddr = lcfs_u32_to_file(blkaddr);
 			if (datalayout == EROFS_INODE_CHUNK_BASED) {
 				i.i_u.c.format = lcfs_u16_to_file(chunk_format);
 			}
@@ -888,23 +917,13 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 		i.i_mtime_nsec = lcfs_u32_to_file(node->inode.st_mtim_nsec);
 
 		if (type == S_IFDIR) {
-			if (node->erofs_n_blocks > 0) {
-				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
-			}
+			if (ei->n_blocks > 0)
+				i.i_u.raw_blkaddr = lcfs_u32_to_file(blkaddr);
 		} else if (type == S_IFCHR || type == S_IFBLK) {
 			i.i_u.rdev = lcfs_u32_to_file(node->inode.st_rdev);
 		} else if (type == S_IFREG) {
-			if (node->erofs_n_blocks > 0) {
-				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
-			}
+			if (ei->n_blocks > 0)
+				i.i_u.raw_blkaddr = lcfs_u32_to_file(blkaddr);
 			if (datalayout == EROFS_INODE_CHUNK_BASED) {
 				i.i_u.c.format = lcfs_u16_to_file(chunk_format);
 			}
@@ -961,28 +980,26 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 			return ret;
 	} else if (type == S_IFREG) {
 		if (node->content != NULL) {
-			if (node->erofs_tailsize) {
+			if (ei->tailsize) {
 				uint64_t file_size = node->inode.st_size;
 				ret = lcfs_write(ctx,
 						 node->content + file_size -
-							 node->erofs_tailsize,
-						 node->erofs_tailsize);
+							 ei->tailsize,
+						 ei->tailsize);
 				if (ret < 0)
 					return ret;
 			}
 		} else {
-			for (size_t i = 0; i < chunk_count; i++) {
-				uint32_t empty_chunk = 0xFFFFFFFF;
-				ret = lcfs_write(ctx, &empty_chunk,
-						 sizeof(empty_chunk));
-				if (ret < 0)
-					return ret;
-			}
+			/* All chunks are holes, i.e. EROFS_NULL_ADDR (all ones) */
+			ret = lcfs_write_fill(ctx, 0xFF,
+					      chunk_count * sizeof(uint32_t));
+			if (ret < 0)
+				return ret;
 		}
 	}
 
 	assert(ctx->bytes_written - orig_bytes_written ==
-	       node->erofs_isize + node->erofs_ipad);
+	       ei->isize + ei->ipad);
 
 	return 0;
 }
@@ -1008,15 +1025,16 @@ static int write_erofs_inodes(struct lcfs_ctx_s *ctx)
 /* Writes the non-tailpacked file data, if any */
 static int write_erofs_file_content(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node)
 {
+	struct lcfs_erofs_inode_s *ei = get_erofs_inode(ctx, node);
 	int type = node->inode.st_mode & S_IFMT;
 	off_t size = node->inode.st_size;
 
-	if (type != S_IFREG || node->erofs_n_blocks == 0)
+	if (type != S_IFREG || ei->n_blocks == 0)
 		return 0;
 
 	assert(node->content != NULL);
 
-	for (size_t i = 0; i < node->erofs_n_blocks; i++) {
+	for (size_t i = 0; i < ei->n_blocks; i++) {
 		off_t offset = i * EROFS_BLKSIZ;
 		off_t len = min(size - offset, EROFS_BLKSIZ);
 		int ret;
@@ -1061,6 +1079,146 @@ static int write_erofs_shared_xattrs(struct lcfs_ctx_s *ctx)
 	return 0;
 }
 
+/* Number of nodes per task when writing in parallel */
+#define EROFS_WRITE_BATCH_SIZE 1024
+
+struct erofs_write_batch_s {
+	struct lcfs_ctx_erofs_s *ctx_erofs;
+	struct lcfs_node_s *first;
+	size_t n_nodes;
+	int ret;
+	int errsv;
+};
+
+/* With a mapped image lcfs_write() only copies to map + bytes_written,
+ * so a copy of the context works as an independent write cursor. */
+static void erofs_ctx_at(struct lcfs_ctx_erofs_s *sub,
+			 struct lcfs_ctx_erofs_s *ctx_erofs, uint64_t offset)
+{
+	assert(ctx_erofs->base.map != NULL);
+
+	*sub = *ctx_erofs;
+	sub->base.bytes_written = offset;
+	sub->base.fsverity_ctx = NULL;
+}
+
+/* Writes the inodes of a range of nodes, and their data blocks, at
+ * their precomputed offsets in the image */
+static int write_erofs_batch(struct lcfs_ctx_erofs_s *ctx_erofs,
+			     struct lcfs_node_s *first, size_t n_nodes)
+{
+	struct lcfs_erofs_inode_s *ei = get_erofs_inode(&ctx_erofs->base, first);
+	struct lcfs_ctx_erofs_s sub;
+	struct lcfs_node_s *node;
+	size_t i;
+	int ret;
+
+	/* Offset of the padding before the first inode */
+	erofs_ctx_at(&sub, ctx_erofs,
+		     ctx_erofs->meta_start + ei->nid * EROFS_SLOTSIZE - ei->ipad);
+
+	for (node = first, i = 0; i < n_nodes; node = node->next, i++) {
+		ret = write_erofs_inode_data(&sub.base, node);
+		if (ret < 0)
+			return ret;
+	}
+
+	/* Data blocks are allocated in the same order as the inodes */
+	erofs_ctx_at(&sub, ctx_erofs,
+		     ctx_erofs->data_block_start + (uint64_t)ei->blkaddr * EROFS_BLKSIZ);
+
+	for (node = first, i = 0; i < n_nodes; node = node->next, i++) {
+		ret = write_erofs_dentries(&sub.base, node, true, false);
+		if (ret < 0)
+			return ret;
+		ret = write_erofs_file_content(&sub.base, node);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void write_erofs_batch_task(void *data)
+{
+	struct erofs_write_batch_s *batch = data;
+
+	batch->ret = write_erofs_batch(batch->ctx_erofs, batch->first,
+				       batch->n_nodes);
+	if (batch->ret < 0)
+		batch->errsv = errno;
+}
+
+/* Like write_erofs_inodes(), write_erofs_shared_xattrs() and
+ * write_erofs_data_blocks(), but with the inodes and data blocks
+ * written by the thread pool while the shared xattrs are written
+ * here. Only possible with a mapped image. */
+static int write_erofs_parallel(struct lcfs_ctx_s *ctx)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	size_t n_batches = DIV_ROUND_UP(ctx->num_inodes, EROFS_WRITE_BATCH_SIZE);
+	cleanup_free struct erofs_write_batch_s *batches = NULL;
+	struct lcfs_ctx_erofs_s sub;
+	struct lcfs_node_s *node;
+	lcfs_pool_t *pool;
+	size_t n_pushed;
+	int ret, errsv;
+
+	batches = calloc(n_batches, sizeof(struct erofs_write_batch_s));
+	if (batches == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	node = ctx->root;
+	for (size_t i = 0; i < n_batches; i++) {
+		struct erofs_write_batch_s *batch = &batches[i];
+
+		batch->ctx_erofs = ctx_erofs;
+		batch->first = node;
+		while (node != NULL && batch->n_nodes < EROFS_WRITE_BATCH_SIZE) {
+			batch->n_nodes++;
+			node = node->next;
+		}
+	}
+	assert(node == NULL);
+
+	pool = lcfs_pool_new(ctx->options->n_threads);
+	if (pool == NULL)
+		return -1;
+
+	for (n_pushed = 0; n_pushed < n_batches; n_pushed++) {
+		if (lcfs_pool_push(pool, write_erofs_batch_task,
+				   &batches[n_pushed]) < 0)
+			break;
+	}
+
+	if (n_pushed == n_batches) {
+		erofs_ctx_at(&sub, ctx_erofs, ctx_erofs->inodes_end);
+		ret = write_erofs_shared_xattrs(&sub.base);
+	} else {
+		ret = -1;
+	}
+	errsv = errno;
+
+	lcfs_pool_wait(pool);
+	lcfs_pool_free(pool);
+
+	if (ret < 0) {
+		errno = errsv;
+		return ret;
+	}
+
+	for (size_t i = 0; i < n_batches; i++) {
+		if (batches[i].ret < 0) {
+			errno = batches[i].errsv;
+			return batches[i].ret;
+		}
+	}
+
+	return 0;
+}
+
 static int add_overlayfs_xattrs(struct lcfs_node_s *node)
 {
 	int type = node->inode.st_mode & S_IFMT;
@@ -1090,7 +1248,7 @@ static int add_overlayfs_xattrs(struct lcfs_node_s *node)
 		uint8_t xattr_data[4 + LCFS_DIGEST_SIZE];
 		size_t xattr_len = 0;
 
-		if (node->digest_set) {
+		if (node->digest != NULL) {
 			xattr_len = sizeof(xattr_data);
 			xattr_data[0] = 0; /* version */
 			xattr_data[1] = xattr_len;
@@ -1335,6 +1493,16 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 	if (ret < 0)
 		return ret;
 
+	data_block_start =
+		round_up(ctx_erofs->inodes_end + ctx_erofs->shared_xattr_size,
+			 EROFS_BLKSIZ);
+	ctx_erofs->data_block_start = data_block_start;
+
+	ret = lcfs_write_set_size(ctx, data_block_start + ctx_erofs->n_data_blocks *
+								  EROFS_BLKSIZ);
+	if (ret < 0)
+		return ret;
+
 	header_flags = 0;
 	if (ctx->has_acl)
 		header_flags |= LCFS_EROFS_FLAGS_HAS_ACL;
@@ -1358,17 +1526,14 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 	/* metadata is stored directly after superblock */
 	superblock.meta_blkaddr = lcfs_u32_to_file(
 		(uint32_t)((EROFS_SUPER_OFFSET + sizeof(superblock)) / EROFS_BLKSIZ));
-	assert(root->erofs_nid < UINT16_MAX);
-	superblock.root_nid = lcfs_u16_to_file((uint16_t)root->erofs_nid);
+	assert(get_erofs_inode(ctx, root)->nid < UINT16_MAX);
+	superblock.root_nid =
+		lcfs_u16_to_file((uint16_t)get_erofs_inode(ctx, root)->nid);
 
 	/* shared xattrs is directly after metadata */
 	superblock.xattr_blkaddr =
 		lcfs_u32_to_file((uint32_t)(ctx_erofs->inodes_end / EROFS_BLKSIZ));
 
-	data_block_start =
-		round_up(ctx_erofs->inodes_end + ctx_erofs->shared_xattr_size,
-			 EROFS_BLKSIZ);
-
 	superblock.blocks =
 		lcfs_u32_to_file((uint32_t)(data_block_start / EROFS_BLKSIZ +
 					    ctx_erofs->n_data_blocks));
@@ -1382,7 +1547,16 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 	if (ret < 0)
 		return ret;
 
-	ctx_erofs->current_end = data_block_start;
+	if (ctx->map != NULL && ctx->options->n_threads > 1) {
+		ret = write_erofs_parallel(ctx);
+		if (ret < 0)
+			return ret;
+
+		/* Everything after the superblock is written */
+		ctx->bytes_written = data_block_start +
+				     ctx_erofs->n_data_blocks * EROFS_BLKSIZ;
+		return 0;
+	}
 
 	ret = write_erofs_inodes(ctx);
 	if (ret < 0)
@@ -1408,7 +1582,6 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 	if (ret < 0)
 		return ret;
 
-	assert(ctx_erofs->current_end == (uint64_t)ctx->bytes_written);
 	assert(data_block_start + ctx_erofs->n_data_blocks * EROFS_BLKSIZ ==
 	       (uint64_t)ctx->bytes_written);
 
@@ -22,6 +22,8 @@
 #include "lcfs-writer.h"
 #include "lcfs-utils.h"
 #include "lcfs-fsverity.h"
+#include "lcfs-pool.h"
+#include "lcfs-uring.h"
 #include "hash.h"
 
 #include <errno.h>
@@ -35,9 +37,15 @@
 #include <sys/param.h>
 #include <assert.h>
 #include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fsverity.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 static void lcfs_node_remove_all_children(struct lcfs_node_s *node);
 static void lcfs_node_destroy(struct lcfs_node_s *node);
+static void lcfs_node_free_children_index(struct lcfs_node_s *node);
 
 static int lcfs_close(struct lcfs_ctx_s *ctx);
 
@@ -95,6 +103,12 @@ static struct lcfs_ctx_s *lcfs_new_ctx(struct lcfs_node_s *root,
 
 	ret->file = options->file;
 	ret->write_cb = options->file_write_cb;
+	ret->fd = -1;
+	if (options->flags & LCFS_FLAGS_WRITE_FD) {
+		ret->fd = options->file_fd;
+		ret->write_cb = NULL;
+	}
+
 	if (options->digest_out) {
 		ret->fsverity_ctx = lcfs_fsverity_context_new();
 		if (ret->fsverity_ctx == NULL) {
@@ -103,6 +117,14 @@ static struct lcfs_ctx_s *lcfs_new_ctx(struct lcfs_node_s *root,
 		}
 	}
 
+	if (ret->write_cb || ret->fd >= 0 || ret->fsverity_ctx) {
+		ret->write_buf = malloc(LCFS_WRITE_BUFFER_SIZE);
+		if (ret->write_buf == NULL) {
+			lcfs_close(ret);
+			return NULL;
+		}
+	}
+
 	return ret;
 }
 
@@ -161,6 +183,32 @@ static int cmp_xattr(const void *a, const void *b)
 	return strcmp(na->key, nb->key);
 }
 
+/* Drops the spare room left by geometric growth, as the tree is
+ * normally complete once it is written. Failing to shrink is harmless. */
+static void lcfs_node_shrink_arrays(struct lcfs_node_s *node)
+{
+	if (node->children_allocated > node->children_size &&
+	    node->children_size > 0) {
+		struct lcfs_node_s **children =
+			reallocarray(node->children, sizeof(*node->children),
+				     node->children_size);
+		if (children != NULL) {
+			node->children = children;
+			node->children_allocated = node->children_size;
+		}
+	}
+
+	if (node->xattrs_allocated > node->n_xattrs && node->n_xattrs > 0) {
+		struct lcfs_xattr_s *xattrs =
+			reallocarray(node->xattrs, sizeof(struct lcfs_xattr_s),
+				     node->n_xattrs);
+		if (xattrs != NULL) {
+			node->xattrs = xattrs;
+			node->xattrs_allocated = node->n_xattrs;
+		}
+	}
+}
+
 /* This ensures that the tree is in a well defined order, with
    children sorted by name, and the nodes visited in breadth-first
    order.  It also updates the inode offset. */
@@ -198,10 +246,15 @@ int lcfs_compute_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root)
 			node->inode.st_nlink = n_link;
 		}
 
+		lcfs_node_shrink_arrays(node);
+
 		/* Canonical order */
-		if (node->children)
+		if (node->children) {
 			qsort(node->children, node->children_size,
 			      sizeof(node->children[0]), cmp_nodes);
+			/* The index refers to the old positions */
+			lcfs_node_free_children_index(node);
+		}
 		if (node->xattrs)
 			qsort(node->xattrs, node->n_xattrs,
 			      sizeof(node->xattrs[0]), cmp_xattr);
@@ -268,44 +321,212 @@ struct lcfs_node_s *follow_links(struct lcfs_node_s *node)
 	return node;
 }
 
-int lcfs_write(struct lcfs_ctx_s *ctx, void *_data, size_t data_len)
+static int lcfs_write_out(struct lcfs_ctx_s *ctx, uint8_t *data, size_t data_len)
 {
-	uint8_t *data = _data;
-	if (ctx->fsverity_ctx)
-		lcfs_fsverity_context_update(ctx->fsverity_ctx, data, data_len);
+	while (data_len > 0) {
+		ssize_t r;
 
-	ctx->bytes_written += data_len;
-
-	if (ctx->write_cb) {
-		while (data_len > 0) {
-			ssize_t r = ctx->write_cb(ctx->file, data, data_len);
+		if (ctx->fd >= 0) {
+			r = write(ctx->fd, data, data_len);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				return -1;
+			if (r == 0) {
+				errno = EIO;
+				return -1;
+			}
+		} else if (ctx->write_cb) {
+			r = ctx->write_cb(ctx->file, data, data_len);
 			if (r <= 0) {
 				errno = EIO;
 				return -1;
 			}
-			data_len -= r;
-			data += r;
+		} else {
+			break;
 		}
+
+		data_len -= r;
+		data += r;
 	}
 
 	return 0;
 }
 
-int lcfs_write_pad(struct lcfs_ctx_s *ctx, size_t data_len)
+/* Passes buffered data that is not hashed yet on to the digest */
+static void lcfs_write_hash_buffer(struct lcfs_ctx_s *ctx)
+{
+	if (ctx->fsverity_ctx && ctx->write_buf_used > ctx->write_buf_hashed)
+		lcfs_fsverity_context_update(ctx->fsverity_ctx,
+					     ctx->write_buf + ctx->write_buf_hashed,
+					     ctx->write_buf_used - ctx->write_buf_hashed);
+	ctx->write_buf_hashed = ctx->write_buf_used;
+}
+
+/* Called by writers that know the final image size before they
+ * start writing. With LCFS_FLAGS_WRITE_MMAP, if the output is a
+ * regular file opened for reading and writing, this sizes it and
+ * maps it so the image is written directly into place. Otherwise
+ * the output is written as a stream. */
+int lcfs_write_set_size(struct lcfs_ctx_s *ctx, uint64_t size)
 {
-	char buf[256] = { 0 };
+	struct stat st;
+	void *map;
+	int errsv;
+	int fl;
 
-	for (size_t i = 0; i < data_len; i += sizeof(buf)) {
-		size_t to_write = MIN(sizeof(buf), data_len - i);
-		int r = lcfs_write(ctx, buf, to_write);
-		if (r < 0) {
-			return r;
+	assert(ctx->bytes_written == 0);
+
+	if ((ctx->options->flags & LCFS_FLAGS_WRITE_MMAP) == 0 || ctx->fd < 0 ||
+	    size == 0 || size > SIZE_MAX)
+		return 0;
+
+	/* A shared writable mapping needs read access too */
+	fl = fcntl(ctx->fd, F_GETFL);
+	if (fl < 0 || (fl & O_ACCMODE) != O_RDWR || (fl & O_APPEND) != 0)
+		return 0;
+
+	if (fstat(ctx->fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    lseek(ctx->fd, 0, SEEK_CUR) != 0)
+		return 0;
+
+	/* Map before touching the file, so if that fails the output
+	 * can still be streamed into the file as it is. */
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+	/* Truncate first so all of the file is zero filled */
+	if (ftruncate(ctx->fd, 0) < 0 || ftruncate(ctx->fd, size) < 0)
+		goto fail;
+
+	/* Allocate up front, running out of space while writing to the
+	 * mapping would be a SIGBUS. If that isn't possible (including
+	 * filesystems without fallocate) the image is streamed instead,
+	 * where running out of space is just a write error. */
+	if (fallocate(ctx->fd, 0, 0, size) < 0) {
+		munmap(map, size);
+		return 0;
+	}
+
+	ctx->map = map;
+	ctx->map_size = size;
+
+	return 0;
+
+fail:
+	errsv = errno;
+	munmap(map, size);
+	errno = errsv;
+	return -1;
+}
+
+int lcfs_write_flush(struct lcfs_ctx_s *ctx)
+{
+	size_t used = ctx->write_buf_used;
+
+	lcfs_write_hash_buffer(ctx);
+	ctx->write_buf_used = 0;
+	ctx->write_buf_hashed = 0;
+	if (used == 0)
+		return 0;
+
+	return lcfs_write_out(ctx, ctx->write_buf, used);
+}
+
+/* The writers emit the image in lots of tiny pieces, so these are
+ * collected in a buffer and passed on in large chunks. */
+int lcfs_write(struct lcfs_ctx_s *ctx, void *_data, size_t data_len)
+{
+	uint8_t *data = _data;
+
+	if (ctx->map) {
+		assert(ctx->bytes_written + data_len <= ctx->map_size);
+		memcpy(ctx->map + ctx->bytes_written, data, data_len);
+		ctx->bytes_written += data_len;
+		return 0;
+	}
+
+	ctx->bytes_written += data_len;
+
+	if (ctx->write_buf == NULL)
+		return 0;
+
+	while (data_len > 0) {
+		size_t n;
+
+		/* Large writes skip the buffer if it is empty */
+		if (ctx->write_buf_used == 0 && data_len >= LCFS_WRITE_BUFFER_SIZE) {
+			if (ctx->fsverity_ctx)
+				lcfs_fsverity_context_update(ctx->fsverity_ctx,
+							     data, data_len);
+			return lcfs_write_out(ctx, data, data_len);
 		}
+
+		n = MIN(LCFS_WRITE_BUFFER_SIZE - ctx->write_buf_used, data_len);
+		memcpy(ctx->write_buf + ctx->write_buf_used, data, n);
+		ctx->write_buf_used += n;
+		data += n;
+		data_len -= n;
+
+		if (ctx->write_buf_used == LCFS_WRITE_BUFFER_SIZE &&
+		    lcfs_write_flush(ctx) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Like lcfs_write() with data_len bytes of c, but filled in place.
+ * For runs of zeros of at least a block, the digest is updated
+ * without hashing them. */
+int lcfs_write_fill(struct lcfs_ctx_s *ctx, int c, size_t data_len)
+{
+	bool hash_zeros = c == 0 && ctx->fsverity_ctx != NULL && data_len >= 4096;
+
+	if (ctx->map) {
+		assert(ctx->bytes_written + data_len <= ctx->map_size);
+		/* The file is zero filled already */
+		if (c != 0)
+			memset(ctx->map + ctx->bytes_written, c, data_len);
+		ctx->bytes_written += data_len;
+		return 0;
+	}
+
+	if (ctx->write_buf == NULL) {
+		ctx->bytes_written += data_len;
+		return 0;
+	}
+
+	if (hash_zeros) {
+		lcfs_write_hash_buffer(ctx);
+		lcfs_fsverity_context_update_zeros(ctx->fsverity_ctx, data_len);
+	}
+
+	while (data_len > 0) {
+		size_t n = MIN(LCFS_WRITE_BUFFER_SIZE - ctx->write_buf_used,
+			       data_len);
+
+		memset(ctx->write_buf + ctx->write_buf_used, c, n);
+		ctx->write_buf_used += n;
+		if (hash_zeros)
+			ctx->write_buf_hashed = ctx->write_buf_used;
+		ctx->bytes_written += n;
+		data_len -= n;
+
+		if (ctx->write_buf_used == LCFS_WRITE_BUFFER_SIZE &&
+		    lcfs_write_flush(ctx) < 0)
+			return -1;
 	}
 
 	return 0;
 }
 
+int lcfs_write_pad(struct lcfs_ctx_s *ctx, size_t data_len)
+{
+	return lcfs_write_fill(ctx, 0, data_len);
+}
+
 int lcfs_write_align(struct lcfs_ctx_s *ctx, size_t align_size)
 {
 	off_t end = round_up(ctx->bytes_written, align_size);
@@ -325,6 +546,9 @@ static int lcfs_close(struct lcfs_ctx_s *ctx)
 
 	if (ctx->fsverity_ctx)
 		lcfs_fsverity_context_free(ctx->fsverity_ctx);
+	free(ctx->write_buf);
+	if (ctx->map)
+		munmap(ctx->map, ctx->map_size);
 	if (ctx->root) {
 		if (ctx->destroy_root) {
 			lcfs_node_destroy(ctx->root);
@@ -362,22 +586,40 @@ int lcfs_write_to(struct lcfs_node_s *root, struct lcfs_write_options_s *options
 		res = -1;
 	}
 
+	if (res >= 0 && ctx->map) {
+		assert((size_t)ctx->bytes_written == ctx->map_size);
+		/* The whole image is available, so hash it in parallel */
+		if (options->digest_out)
+			res = lcfs_compute_fsverity_parallel(options->digest_out,
+							     ctx->map, ctx->map_size,
+							     options->n_threads);
+	} else if (res >= 0) {
+		res = lcfs_write_flush(ctx);
+		if (res >= 0 && options->digest_out)
+			lcfs_fsverity_context_get_digest(ctx->fsverity_ctx,
+							 options->digest_out);
+	}
+
 	if (res < 0) {
 		lcfs_close(ctx);
 		return res;
 	}
 
-	if (options->digest_out) {
-		lcfs_fsverity_context_get_digest(ctx->fsverity_ctx,
-						 options->digest_out);
-	}
+	options->mapped = ctx->map != NULL;
 
 	lcfs_close(ctx);
 	return 0;
 }
 
+/* For lcfs_build_stats_s, which may be updated from several threads */
+static void lcfs_count_syscalls(struct lcfs_build_stats_s *stats, uint64_t n)
+{
+	if (stats != NULL)
+		__atomic_fetch_add(&stats->n_syscalls, n, __ATOMIC_RELAXED);
+}
+
 static int read_xattrs(struct lcfs_node_s *ret, int dirfd, const char *fname,
-		       int buildflags)
+		       int buildflags, struct lcfs_build_stats_s *stats)
 {
 	char path[PATH_MAX];
 	ssize_t list_size;
@@ -385,6 +627,10 @@ static int read_xattrs(struct lcfs_node_s *ret, int dirfd, const char *fname,
 	ssize_t r = 0;
 	cleanup_fd int fd = -1;
 	bool user_xattr = (buildflags & LCFS_BUILD_USER_XATTRS) != 0;
+	size_t n_xattrs;
+
+	/* The open, its close and the listxattr calls */
+	lcfs_count_syscalls(stats, 4);
 
 	fd = openat(dirfd, fname, O_PATH | O_NOFOLLOW | O_CLOEXEC, 0);
 	if (fd < 0)
@@ -407,6 +653,14 @@ static int read_xattrs(struct lcfs_node_s *ret, int dirfd, const char *fname,
 		return list_size;
 	}
 
+	/* Upper bound, with user_xattr some are skipped */
+	n_xattrs = 0;
+	for (const char *it = list; it < list + list_size; it += strlen(it) + 1)
+		n_xattrs++;
+	r = lcfs_node_reserve_xattrs(ret, ret->n_xattrs + n_xattrs);
+	if (r < 0)
+		return r;
+
 	for (const char *it = list; it < list + list_size; it += strlen(it) + 1) {
 		ssize_t value_size;
 		cleanup_free char *value = NULL;
@@ -414,6 +668,8 @@ static int read_xattrs(struct lcfs_node_s *ret, int dirfd, const char *fname,
 		if (user_xattr && !str_has_prefix(it, "user."))
 			continue;
 
+		lcfs_count_syscalls(stats, 2);
+
 		value_size = getxattr(path, it, NULL, 0);
 		if (value_size < 0) {
 			return value_size;
@@ -448,6 +704,69 @@ struct lcfs_node_s *lcfs_node_new(void)
 	return node;
 }
 
+/* Nodes in an arena are not freed individually, all memory is released
+ * when the last node referring to the arena is gone. This avoids lots
+ * of small allocations for large trees. */
+static struct lcfs_node_s *lcfs_node_new_in_arena(lcfs_arena_t *arena)
+{
+	struct lcfs_node_s *node;
+
+	if (arena == NULL)
+		return lcfs_node_new();
+
+	node = lcfs_arena_alloc(arena, sizeof(struct lcfs_node_s));
+	if (node == NULL)
+		return NULL;
+	memset(node, 0, sizeof(struct lcfs_node_s));
+
+	node->arena = lcfs_arena_ref(arena);
+	node->ref_count = 1;
+	node->inode.st_nlink = 1;
+	return node;
+}
+
+/* Allocation helpers for data owned by a node */
+static void *lcfs_node_memdup(struct lcfs_node_s *node, const void *data,
+			      size_t size)
+{
+	void *res;
+
+	if (node->arena)
+		res = lcfs_arena_memdup(node->arena, data, size);
+	else
+		res = memdup(data, size);
+	if (res == NULL)
+		errno = ENOMEM;
+
+	return res;
+}
+
+static char *lcfs_node_strdup(struct lcfs_node_s *node, const char *str)
+{
+	return lcfs_node_memdup(node, str, strlen(str) + 1);
+}
+
+static void lcfs_node_free(struct lcfs_node_s *node, void *ptr)
+{
+	if (node->arena == NULL)
+		free(ptr);
+}
+
+/* The digest is stored out of line, as many nodes don't have one */
+static int lcfs_node_store_digest(struct lcfs_node_s *node,
+				  const uint8_t *digest)
+{
+	if (node->digest == NULL) {
+		node->digest = lcfs_node_memdup(node, digest, LCFS_DIGEST_SIZE);
+		if (node->digest == NULL)
+			return -1;
+	} else {
+		memcpy(node->digest, digest, LCFS_DIGEST_SIZE);
+	}
+
+	return 0;
+}
+
 static ssize_t fsverity_read_cb(void *_fd, void *buf, size_t count)
 {
 	int fd = *(int *)_fd;
@@ -460,12 +779,21 @@ static ssize_t fsverity_read_cb(void *_fd, void *buf, size_t count)
 	return res;
 }
 
+/* Read several blocks at a time so they can be hashed in parallel */
+#define FSVERITY_READ_BUFFER_SIZE (64 * 1024)
+
 int lcfs_compute_fsverity_from_content(uint8_t *digest, void *file, lcfs_read_cb read_cb)
 {
-	uint8_t buffer[4096];
+	cleanup_free uint8_t *buffer = NULL;
 	ssize_t n_read;
 	FsVerityContext *ctx;
 
+	buffer = malloc(FSVERITY_READ_BUFFER_SIZE);
+	if (buffer == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
 	ctx = lcfs_fsverity_context_new();
 	if (ctx == NULL) {
 		errno = ENOMEM;
@@ -473,7 +801,7 @@ int lcfs_compute_fsverity_from_content(uint8_t *digest, void *file, lcfs_read_cb
 	}
 
 	while (true) {
-		n_read = read_cb(file, buffer, sizeof(buffer));
+		n_read = read_cb(file, buffer, FSVERITY_READ_BUFFER_SIZE);
 		if (n_read < 0) {
 			lcfs_fsverity_context_free(ctx);
 			errno = ENODATA;
@@ -491,15 +819,133 @@ int lcfs_compute_fsverity_from_content(uint8_t *digest, void *file, lcfs_read_cb
 	return 0;
 }
 
-int lcfs_compute_fsverity_from_fd(uint8_t *digest, int fd)
+/* lcfs_compute_fsverity_from_fd() reads files with up to this much at
+ * a time, aligned to the page size, which means fewer syscalls, and
+ * that only the last block of each read is copied by the context */
+#define FSVERITY_FD_BUFFER_SIZE (1024 * 1024)
+
+/* Feeds the rest of fd to ctx */
+static int fsverity_update_from_fd(FsVerityContext *ctx, int fd,
+				   uint8_t *buffer, size_t buffer_size,
+				   struct lcfs_build_stats_s *stats)
 {
-	int _fd = fd;
-	return lcfs_compute_fsverity_from_content(digest, &_fd, fsverity_read_cb);
+	for (;;) {
+		ssize_t n_read;
+
+		do {
+			lcfs_count_syscalls(stats, 1);
+			n_read = read(fd, buffer, buffer_size);
+		} while (n_read < 0 && errno == EINTR);
+		if (n_read < 0)
+			return -1;
+		if (n_read == 0)
+			return 0;
+
+		lcfs_fsverity_context_update(ctx, buffer, n_read);
+	}
 }
 
-int lcfs_compute_fsverity_from_data(uint8_t *digest, uint8_t *data, size_t data_len)
+/* Feeds the data extents of fd from pos to ctx, and the holes between
+ * them as zeros, which are neither read nor hashed */
+static int fsverity_update_sparse(FsVerityContext *ctx, int fd, off_t pos,
+				  uint8_t *buffer, size_t buffer_size,
+				  struct lcfs_build_stats_s *stats)
+{
+	for (;;) {
+		off_t data;
+		off_t hole;
+
+		lcfs_count_syscalls(stats, 1);
+		data = lseek(fd, pos, SEEK_DATA);
+		if (data < 0) {
+			if (errno != ENXIO)
+				return -1;
+
+			/* Only a hole is left */
+			lcfs_count_syscalls(stats, 1);
+			data = lseek(fd, 0, SEEK_END);
+			if (data < 0)
+				return -1;
+			if (data > pos)
+				lcfs_fsverity_context_update_zeros(ctx, data - pos);
+			return 0;
+		}
+
+		if (data > pos)
+			lcfs_fsverity_context_update_zeros(ctx, data - pos);
+
+		lcfs_count_syscalls(stats, 1);
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0)
+			return -1;
+
+		for (pos = data; pos < hole;) {
+			ssize_t n_read;
+
+			do {
+				lcfs_count_syscalls(stats, 1);
+				n_read = pread(fd, buffer,
+					       MIN(buffer_size, (uint64_t)(hole - pos)),
+					       pos);
+			} while (n_read < 0 && errno == EINTR);
+			if (n_read < 0)
+				return -1;
+			if (n_read == 0)
+				return 0; /* Truncated while reading */
+
+			lcfs_fsverity_context_update(ctx, buffer, n_read);
+			pos += n_read;
+		}
+	}
+}
+
+/* Fewer blocks allocated than the size needs */
+static bool lcfs_stat_is_sparse(const struct stat *sb)
+{
+	return S_ISREG(sb->st_mode) &&
+	       (uint64_t)sb->st_blocks * 512 < (uint64_t)sb->st_size;
+}
+
+/* Same as lcfs_compute_fsverity_from_content() for an fd, but with a
+ * buffer sized for the file (up to FSVERITY_FD_BUFFER_SIZE), and sparse
+ * files are read extent by extent, skipping the holes. Files larger
+ * than the buffer are read with sequential readahead, and dropped from
+ * the page cache afterwards, so hashing a large tree doesn't push out
+ * everything else. The syscalls used are counted in stats. */
+static int lcfs_compute_fsverity_from_fd_stats(uint8_t *digest, int fd,
+					       struct lcfs_build_stats_s *stats)
 {
+	cleanup_free void *buffer = NULL;
 	FsVerityContext *ctx;
+	size_t buffer_size;
+	struct stat sb;
+	bool streaming;
+	off_t pos = -1;
+	int _fd = fd;
+	int r;
+
+	lcfs_count_syscalls(stats, 1);
+	if (fstat(fd, &sb) < 0)
+		return lcfs_compute_fsverity_from_content(digest, &_fd,
+							  fsverity_read_cb);
+
+	/* Like reading, start at the current offset */
+	if (lcfs_stat_is_sparse(&sb)) {
+		lcfs_count_syscalls(stats, 1);
+		pos = lseek(fd, 0, SEEK_CUR);
+	}
+
+	/* One more block, so small files take a single read before EOF */
+	buffer_size = MIN((uint64_t)FSVERITY_FD_BUFFER_SIZE,
+			  round_up((uint64_t)MAX(sb.st_size, 0) + 1,
+				   LCFS_FSVERITY_BLOCK_SIZE));
+	streaming = S_ISREG(sb.st_mode) &&
+		    (uint64_t)sb.st_size > FSVERITY_FD_BUFFER_SIZE;
+
+	if (posix_memalign(&buffer, LCFS_FSVERITY_BLOCK_SIZE, buffer_size) != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
 
 	ctx = lcfs_fsverity_context_new();
 	if (ctx == NULL) {
@@ -507,7 +953,26 @@ int lcfs_compute_fsverity_from_data(uint8_t *digest, uint8_t *data, size_t data_
 		return -1;
 	}
 
-	lcfs_fsverity_context_update(ctx, data, data_len);
+	if (streaming) {
+		lcfs_count_syscalls(stats, 1);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	if (pos >= 0)
+		r = fsverity_update_sparse(ctx, fd, pos, buffer, buffer_size, stats);
+	else
+		r = fsverity_update_from_fd(ctx, fd, buffer, buffer_size, stats);
+
+	if (streaming) {
+		lcfs_count_syscalls(stats, 1);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	if (r < 0) {
+		lcfs_fsverity_context_free(ctx);
+		errno = ENODATA;
+		return -1;
+	}
 
 	lcfs_fsverity_context_get_digest(ctx, digest);
 
@@ -516,55 +981,230 @@ int lcfs_compute_fsverity_from_data(uint8_t *digest, uint8_t *data, size_t data_
 	return 0;
 }
 
-int lcfs_node_set_fsverity_from_content(struct lcfs_node_s *node, void *file,
-					lcfs_read_cb read_cb)
+int lcfs_compute_fsverity_from_fd(uint8_t *digest, int fd)
 {
-	uint8_t digest[LCFS_DIGEST_SIZE];
+	return lcfs_compute_fsverity_from_fd_stats(digest, fd, NULL);
+}
+
+/* Gets the digest from the kernel if fs-verity is enabled for the file.
+ * This is only used if it uses the same parameters as we do, so that the
+ * digest is the same as lcfs_compute_fsverity_from_fd() would give.
+ * Fails with ENODATA if the digest is not available or not usable.
+ */
+int lcfs_measure_fsverity_from_fd(uint8_t *digest, int fd)
+{
+	struct {
+		struct fsverity_digest fsv;
+		uint8_t buf[64];
+	} buf;
+#ifdef FS_IOC_READ_VERITY_METADATA
+	/* Start of struct fsverity_descriptor */
+	struct {
+		uint8_t version;
+		uint8_t hash_algorithm;
+		uint8_t log_blocksize;
+		uint8_t salt_size;
+	} descriptor;
+	struct fsverity_read_metadata_arg arg = {
+		.metadata_type = FS_VERITY_METADATA_TYPE_DESCRIPTOR,
+		.offset = 0,
+		.length = sizeof(descriptor),
+		.buf_ptr = (uintptr_t)&descriptor,
+	};
+#endif
+	int r;
 
-	if (lcfs_compute_fsverity_from_content(digest, file, read_cb) < 0)
+	buf.fsv.digest_size = sizeof(buf.buf);
+	r = ioctl(fd, FS_IOC_MEASURE_VERITY, &buf.fsv);
+	if (r < 0) {
+		if (errno == EOPNOTSUPP || errno == ENOTTY)
+			errno = ENODATA;
 		return -1;
+	}
 
-	lcfs_node_set_fsverity_digest(node, digest);
+	if (buf.fsv.digest_algorithm != FS_VERITY_HASH_ALG_SHA256 ||
+	    buf.fsv.digest_size != LCFS_DIGEST_SIZE) {
+		errno = ENODATA;
+		return -1;
+	}
 
-	return 0;
-}
+#ifdef FS_IOC_READ_VERITY_METADATA
+	/* The digest doesn't tell us the block size or salt */
+	r = ioctl(fd, FS_IOC_READ_VERITY_METADATA, &arg);
+	if (r != sizeof(descriptor) || descriptor.log_blocksize != 12 ||
+	    descriptor.salt_size != 0) {
+		errno = ENODATA;
+		return -1;
+	}
+#else
+	/* No way to check the parameters */
+	errno = ENODATA;
+	return -1;
+#endif
 
-int lcfs_node_set_fsverity_from_fd(struct lcfs_node_s *node, int fd)
-{
-	int _fd = fd;
-	return lcfs_node_set_fsverity_from_content(node, &_fd, fsverity_read_cb);
+	memcpy(digest, buf.fsv.digest, LCFS_DIGEST_SIZE);
+	return 0;
 }
 
-static int read_content(int fd, size_t size, uint8_t *buf)
+int lcfs_compute_fsverity_from_data(uint8_t *digest, uint8_t *data, size_t data_len)
 {
-	int bytes_read;
+	FsVerityContext *ctx;
 
-	while (size > 0) {
-		do
-			bytes_read = read(fd, buf, size);
-		while (bytes_read < 0 && errno == EINTR);
+	ctx = lcfs_fsverity_context_new();
+	if (ctx == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
 
-		if (bytes_read == 0)
-			break;
+	lcfs_fsverity_context_update(ctx, data, data_len);
 
-		size -= bytes_read;
-		buf += bytes_read;
-	}
+	lcfs_fsverity_context_get_digest(ctx, digest);
 
-	if (size > 0) {
-		errno = ENODATA;
-		return -1;
-	}
+	lcfs_fsverity_context_free(ctx);
 
 	return 0;
 }
 
-static void digest_to_path(const uint8_t *csum, char *buf)
+/* Data blocks per task in lcfs_compute_fsverity_parallel() */
+#define FSVERITY_TASK_BLOCKS 256
+
+struct fsverity_task_s {
+	uint8_t *data;
+	size_t n_blocks;
+	uint8_t (*digests)[LCFS_DIGEST_SIZE];
+	bool failed;
+};
+
+static void fsverity_task(void *data)
 {
-	static const char hexchars[] = "0123456789abcdef";
-	uint32_t i, j;
+	struct fsverity_task_s *task = data;
+	FsVerityContext *ctx;
 
-	for (i = 0, j = 0; i < LCFS_DIGEST_SIZE; i++, j += 2) {
+	ctx = lcfs_fsverity_context_new();
+	if (ctx == NULL) {
+		task->failed = true;
+		return;
+	}
+
+	lcfs_fsverity_hash_blocks(ctx, task->data, task->n_blocks, task->digests);
+	lcfs_fsverity_context_free(ctx);
+}
+
+/* Same as lcfs_compute_fsverity_from_data(), but the data blocks are
+ * hashed by n_threads threads. Only the upper levels of the tree,
+ * which are a small fraction of the work, are computed serially. */
+int lcfs_compute_fsverity_parallel(uint8_t *digest, uint8_t *data,
+				   size_t data_len, size_t n_threads)
+{
+	/* The last block is passed on as data, see
+	 * lcfs_fsverity_context_update_digests() */
+	size_t n_blocks = data_len > 0 ? (data_len - 1) / LCFS_FSVERITY_BLOCK_SIZE : 0;
+	size_t n_tasks = (n_blocks + FSVERITY_TASK_BLOCKS - 1) / FSVERITY_TASK_BLOCKS;
+	cleanup_free uint8_t(*digests)[LCFS_DIGEST_SIZE] = NULL;
+	cleanup_free struct fsverity_task_s *tasks = NULL;
+	size_t tail_start = n_blocks * LCFS_FSVERITY_BLOCK_SIZE;
+	FsVerityContext *ctx;
+	lcfs_pool_t *pool;
+
+	if (n_threads <= 1 || n_tasks <= 1)
+		return lcfs_compute_fsverity_from_data(digest, data, data_len);
+
+	digests = calloc(n_blocks, LCFS_DIGEST_SIZE);
+	tasks = calloc(n_tasks, sizeof(struct fsverity_task_s));
+	if (digests == NULL || tasks == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pool = lcfs_pool_new(n_threads);
+	if (pool == NULL)
+		return -1;
+
+	for (size_t i = 0; i < n_tasks; i++) {
+		struct fsverity_task_s *task = &tasks[i];
+		size_t first = i * FSVERITY_TASK_BLOCKS;
+
+		task->data = data + first * LCFS_FSVERITY_BLOCK_SIZE;
+		task->n_blocks = MIN(n_blocks - first, FSVERITY_TASK_BLOCKS);
+		task->digests = digests + first;
+
+		if (lcfs_pool_push(pool, fsverity_task, task) < 0)
+			fsverity_task(task);
+	}
+
+	lcfs_pool_wait(pool);
+	lcfs_pool_free(pool);
+
+	for (size_t i = 0; i < n_tasks; i++) {
+		if (tasks[i].failed) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	ctx = lcfs_fsverity_context_new();
+	if (ctx == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	lcfs_fsverity_context_update_digests(ctx, digests, n_blocks);
+	lcfs_fsverity_context_update(ctx, data + tail_start, data_len - tail_start);
+	lcfs_fsverity_context_get_digest(ctx, digest);
+	lcfs_fsverity_context_free(ctx);
+
+	return 0;
+}
+
+int lcfs_node_set_fsverity_from_content(struct lcfs_node_s *node, void *file,
+					lcfs_read_cb read_cb)
+{
+	uint8_t digest[LCFS_DIGEST_SIZE];
+
+	if (lcfs_compute_fsverity_from_content(digest, file, read_cb) < 0)
+		return -1;
+
+	return lcfs_node_store_digest(node, digest);
+}
+
+int lcfs_node_set_fsverity_from_fd(struct lcfs_node_s *node, int fd)
+{
+	int _fd = fd;
+	return lcfs_node_set_fsverity_from_content(node, &_fd, fsverity_read_cb);
+}
+
+static int read_content(int fd, size_t size, uint8_t *buf,
+			struct lcfs_build_stats_s *stats)
+{
+	int bytes_read;
+
+	while (size > 0) {
+		do {
+			lcfs_count_syscalls(stats, 1);
+			bytes_read = read(fd, buf, size);
+		} while (bytes_read < 0 && errno == EINTR);
+
+		if (bytes_read == 0)
+			break;
+
+		size -= bytes_read;
+		buf += bytes_read;
+	}
+
+	if (size > 0) {
+		errno = ENODATA;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void digest_to_path(const uint8_t *csum, char *buf)
+{
+	static const char hexchars[] = "0123456789abcdef";
+	uint32_t i, j;
+
+	for (i = 0, j = 0; i < LCFS_DIGEST_SIZE; i++, j += 2) {
 		uint8_t byte = csum[i];
 		if (i == 1)
 			buf[j++] = '/';
@@ -574,92 +1214,241 @@ static void digest_to_path(const uint8_t *csum, char *buf)
 	buf[j] = '\0';
 }
 
-struct lcfs_node_s *lcfs_load_node_from_file(int dirfd, const char *fname,
-					     int buildflags)
+/* Gets the digest of a file without reading it, from the digest cache
+ * (sb is only used for that) or from the kernel with
+ * LCFS_BUILD_MEASURE_DIGEST. */
+static bool lcfs_lookup_digest(int fd, const struct stat *sb, int buildflags,
+			       struct lcfs_digest_cache_s *cache,
+			       struct lcfs_build_stats_s *stats, uint8_t *digest)
 {
-	cleanup_node struct lcfs_node_s *ret = NULL;
-	struct stat sb;
+	bool measure_digest = (buildflags & LCFS_BUILD_MEASURE_DIGEST) != 0;
+
+	if (cache != NULL && lcfs_digest_cache_lookup(cache, sb, digest))
+		return true;
+	if (measure_digest) {
+		lcfs_count_syscalls(stats, 1);
+		if (lcfs_measure_fsverity_from_fd(digest, fd) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/* Sets the digest and/or by-digest payload of a regular file node as
+ * requested by LCFS_BUILD_COMPUTE_DIGEST and LCFS_BUILD_BY_DIGEST. */
+static int lcfs_node_apply_digest(struct lcfs_node_s *node,
+				  const uint8_t *digest, int buildflags)
+{
+	bool compute_digest = (buildflags & LCFS_BUILD_COMPUTE_DIGEST) != 0;
+	bool by_digest = (buildflags & LCFS_BUILD_BY_DIGEST) != 0;
 	int r;
 
-	if (buildflags & ~(LCFS_BUILD_SKIP_XATTRS | LCFS_BUILD_USE_EPOCH |
-			   LCFS_BUILD_SKIP_DEVICES | LCFS_BUILD_COMPUTE_DIGEST |
-			   LCFS_BUILD_NO_INLINE | LCFS_BUILD_USER_XATTRS |
-			   LCFS_BUILD_BY_DIGEST)) {
-		errno = EINVAL;
-		return NULL;
+	/* With only by_digest, we just computed digest to get the payload path */
+	if (compute_digest || !by_digest) {
+		r = lcfs_node_store_digest(node, digest);
+		if (r < 0)
+			return -1;
 	}
 
-	if ((buildflags & LCFS_BUILD_SKIP_XATTRS) &&
-	    (buildflags & LCFS_BUILD_USER_XATTRS)) {
-		/* These conflict */
-		errno = EINVAL;
-		return NULL;
+	if (by_digest) {
+		char digest_path[LCFS_DIGEST_SIZE * 2 + 2];
+		digest_to_path(digest, digest_path);
+		r = lcfs_node_set_payload(node, digest_path);
+		if (r < 0)
+			return -1;
 	}
 
-	r = fstatat(dirfd, fname, &sb, AT_SYMLINK_NOFOLLOW);
-	if (r < 0)
-		return NULL;
+	return 0;
+}
+
+/* Sets the digest and/or by-digest payload of a regular file node as
+ * requested by LCFS_BUILD_COMPUTE_DIGEST and LCFS_BUILD_BY_DIGEST. If
+ * there is a digest cache it is used for unchanged files, and updated
+ * for the others. With LCFS_BUILD_LAZY_DIGEST files that would need to
+ * be read are left without digest, for the caller to handle. */
+static int lcfs_node_set_digest_from_fd(struct lcfs_node_s *node, int fd,
+					const struct stat *sb, int buildflags,
+					struct lcfs_digest_cache_s *cache,
+					struct lcfs_build_stats_s *stats)
+{
+	bool lazy_digest = (buildflags & LCFS_BUILD_LAZY_DIGEST) != 0;
+	uint8_t digest[LCFS_DIGEST_SIZE];
+	struct stat fd_sb;
+	int r;
+
+	/* The stat from loading the node is reused when there is one */
+	if (cache != NULL && sb == NULL) {
+		lcfs_count_syscalls(stats, 1);
+		if (fstat(fd, &fd_sb) < 0)
+			return -1;
+		sb = &fd_sb;
+	}
+
+	if (!lcfs_lookup_digest(fd, sb, buildflags, cache, stats, digest)) {
+		if (lazy_digest)
+			return 0;
+
+		r = lcfs_compute_fsverity_from_fd_stats(digest, fd, stats);
+		if (r < 0)
+			return -1;
+
+		if (cache != NULL && lcfs_digest_cache_insert(cache, sb, digest) < 0)
+			return -1;
+	}
+
+	return lcfs_node_apply_digest(node, digest, buildflags);
+}
+
+/* The io_uring builder uses these with IORING_OP_STATX */
+#if defined(HAVE_STATX) || defined(HAVE_IO_URING)
+static void stat_from_statx(struct stat *sb, const struct statx *stx)
+{
+	memset(sb, 0, sizeof(*sb));
+	sb->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	sb->st_ino = stx->stx_ino;
+	sb->st_mode = stx->stx_mode;
+	sb->st_nlink = stx->stx_nlink;
+	sb->st_uid = stx->stx_uid;
+	sb->st_gid = stx->stx_gid;
+	sb->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	sb->st_size = stx->stx_size;
+	sb->st_blksize = stx->stx_blksize;
+	sb->st_blocks = stx->stx_blocks;
+	sb->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* Only what lcfs_load_node_with_stat() stores, what hardlink
+ * detection and sparse files need, and what the digest cache
+ * compares, so the filesystem can skip getting the rest */
+static unsigned int lcfs_statx_mask(struct lcfs_digest_cache_s *cache)
+{
+	unsigned int mask = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID |
+			    STATX_SIZE | STATX_MTIME | STATX_NLINK | STATX_INO |
+			    STATX_BLOCKS;
+
+	if (cache != NULL)
+		mask |= STATX_CTIME;
+
+	return mask;
+}
+
+static int lcfs_statx_flags(int buildflags)
+{
+	int flags = AT_SYMLINK_NOFOLLOW;
+
+	if (buildflags & LCFS_BUILD_STAT_DONT_SYNC)
+		flags |= AT_STATX_DONT_SYNC;
+
+	return flags;
+}
+#endif
+
+/* Gets the attributes of a source file, once for the directory walk
+ * and lcfs_load_node_with_stat() */
+static int lcfs_stat(int dirfd, const char *fname, int buildflags,
+		     struct lcfs_digest_cache_s *cache,
+		     struct lcfs_build_stats_s *stats, struct stat *sb)
+{
+#ifdef HAVE_STATX
+	struct statx stx;
+
+	lcfs_count_syscalls(stats, 1);
+
+	if (statx(dirfd, fname, lcfs_statx_flags(buildflags),
+		  lcfs_statx_mask(cache), &stx) < 0)
+		return -1;
+
+	stat_from_statx(sb, &stx);
+	return 0;
+#else
+	lcfs_count_syscalls(stats, 1);
+
+	return fstatat(dirfd, fname, sb, AT_SYMLINK_NOFOLLOW);
+#endif
+}
+
+/* Does the work of lcfs_load_node(), given the result of lcfs_stat() */
+static struct lcfs_node_s *lcfs_load_node_with_stat(int dirfd, const char *fname,
+						    const struct stat *sb,
+						    int buildflags,
+						    struct lcfs_digest_cache_s *cache,
+						    lcfs_arena_t *arena,
+						    struct lcfs_build_stats_s *stats)
+{
+	cleanup_node struct lcfs_node_s *ret = NULL;
+	int r;
 
-	ret = lcfs_node_new();
+	ret = lcfs_node_new_in_arena(arena);
 	if (ret == NULL)
 		return NULL;
 
-	ret->inode.st_mode = sb.st_mode;
-	ret->inode.st_uid = sb.st_uid;
-	ret->inode.st_gid = sb.st_gid;
-	ret->inode.st_rdev = sb.st_rdev;
-	ret->inode.st_size = sb.st_size;
+	if (stats != NULL)
+		__atomic_fetch_add(&stats->n_inodes, 1, __ATOMIC_RELAXED);
+
+	ret->inode.st_mode = sb->st_mode;
+	ret->inode.st_uid = sb->st_uid;
+	ret->inode.st_gid = sb->st_gid;
+	ret->inode.st_rdev = sb->st_rdev;
+	ret->inode.st_size = sb->st_size;
 
-	if ((sb.st_mode & S_IFMT) == S_IFREG) {
+	if ((sb->st_mode & S_IFMT) == S_IFREG) {
 		bool compute_digest = (buildflags & LCFS_BUILD_COMPUTE_DIGEST) != 0;
 		bool by_digest = (buildflags & LCFS_BUILD_BY_DIGEST) != 0;
 		bool no_inline = (buildflags & LCFS_BUILD_NO_INLINE) != 0;
-		bool is_zerosized = sb.st_size == 0;
+		bool is_zerosized = sb->st_size == 0;
 		bool do_digest = !is_zerosized && (compute_digest || by_digest);
 		bool do_inline = !is_zerosized && !no_inline &&
-				 sb.st_size <= LCFS_BUILD_INLINE_FILE_SIZE_LIMIT;
+				 sb->st_size <= LCFS_BUILD_INLINE_FILE_SIZE_LIMIT;
 
 		if (do_digest || do_inline) {
-			cleanup_fd int fd =
-				openat(dirfd, fname, O_RDONLY | O_CLOEXEC);
+			cleanup_fd int fd = -1;
+
+			/* The open and its close */
+			lcfs_count_syscalls(stats, 2);
+
+			fd = openat(dirfd, fname, O_RDONLY | O_CLOEXEC);
 			if (fd < 0)
 				return NULL;
 			if (do_digest) {
-				r = lcfs_node_set_fsverity_from_fd(ret, fd);
+				/* Inline files are read anyway, so there is
+				 * no point in being lazy about them */
+				int digest_flags = buildflags;
+				if (do_inline)
+					digest_flags &= ~LCFS_BUILD_LAZY_DIGEST;
+
+				r = lcfs_node_set_digest_from_fd(ret, fd, sb,
+								 digest_flags,
+								 cache, stats);
 				if (r < 0)
 					return NULL;
-
-				if (by_digest) {
-					const uint8_t *digest =
-						lcfs_node_get_fsverity_digest(ret);
-					char digest_path[LCFS_DIGEST_SIZE * 2 + 2];
-					digest_to_path(digest, digest_path);
-					r = lcfs_node_set_payload(ret, digest_path);
-					if (r < 0)
-						return NULL;
-
-					/* We just computed digest to get the payoad path */
-					if (!compute_digest)
-						ret->digest_set = false;
-				}
-
-				/* In case we re-read below */
-				lseek(fd, 0, SEEK_SET);
 			}
 			if (do_inline) {
 				uint8_t buf[LCFS_BUILD_INLINE_FILE_SIZE_LIMIT];
 
-				r = read_content(fd, sb.st_size, buf);
+				/* In case the digest read it */
+				if (do_digest) {
+					lcfs_count_syscalls(stats, 1);
+					lseek(fd, 0, SEEK_SET);
+				}
+
+				r = read_content(fd, sb->st_size, buf, stats);
 				if (r < 0)
 					return NULL;
-				r = lcfs_node_set_content(ret, buf, sb.st_size);
+				r = lcfs_node_set_content(ret, buf, sb->st_size);
 				if (r < 0)
 					return NULL;
 			}
 		}
-	} else if ((sb.st_mode & S_IFMT) == S_IFLNK) {
+	} else if ((sb->st_mode & S_IFMT) == S_IFLNK) {
 		char target[PATH_MAX + 1];
 
+		lcfs_count_syscalls(stats, 1);
+
 		r = readlinkat(dirfd, fname, target, sizeof(target));
 		if (r < 0)
 			return NULL;
@@ -671,12 +1460,12 @@ struct lcfs_node_s *lcfs_load_node_from_file(int dirfd, const char *fname,
 	}
 
 	if ((buildflags & LCFS_BUILD_USE_EPOCH) == 0) {
-		ret->inode.st_mtim_sec = sb.st_mtim.tv_sec;
-		ret->inode.st_mtim_nsec = sb.st_mtim.tv_nsec;
+		ret->inode.st_mtim_sec = sb->st_mtim.tv_sec;
+		ret->inode.st_mtim_nsec = sb->st_mtim.tv_nsec;
 	}
 
 	if ((buildflags & LCFS_BUILD_SKIP_XATTRS) == 0) {
-		r = read_xattrs(ret, dirfd, fname, buildflags);
+		r = read_xattrs(ret, dirfd, fname, buildflags, stats);
 		if (r < 0)
 			return NULL;
 	}
@@ -684,6 +1473,46 @@ struct lcfs_node_s *lcfs_load_node_from_file(int dirfd, const char *fname,
 	return steal_pointer(&ret);
 }
 
+static struct lcfs_node_s *lcfs_load_node(int dirfd, const char *fname,
+					  int buildflags,
+					  struct lcfs_digest_cache_s *cache,
+					  lcfs_arena_t *arena,
+					  struct lcfs_build_stats_s *stats)
+{
+	struct stat sb;
+	int r;
+
+	if (buildflags & ~(LCFS_BUILD_SKIP_XATTRS | LCFS_BUILD_USE_EPOCH |
+			   LCFS_BUILD_SKIP_DEVICES | LCFS_BUILD_COMPUTE_DIGEST |
+			   LCFS_BUILD_NO_INLINE | LCFS_BUILD_USER_XATTRS |
+			   LCFS_BUILD_BY_DIGEST | LCFS_BUILD_MEASURE_DIGEST |
+			   LCFS_BUILD_LAZY_DIGEST | LCFS_BUILD_USE_ARENA |
+			   LCFS_BUILD_USE_IO_URING | LCFS_BUILD_STAT_DONT_SYNC)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((buildflags & LCFS_BUILD_SKIP_XATTRS) &&
+	    (buildflags & LCFS_BUILD_USER_XATTRS)) {
+		/* These conflict */
+		errno = EINVAL;
+		return NULL;
+	}
+
+	r = lcfs_stat(dirfd, fname, buildflags, cache, stats, &sb);
+	if (r < 0)
+		return NULL;
+
+	return lcfs_load_node_with_stat(dirfd, fname, &sb, buildflags, cache,
+					arena, stats);
+}
+
+struct lcfs_node_s *lcfs_load_node_from_file(int dirfd, const char *fname,
+					     int buildflags)
+{
+	return lcfs_load_node(dirfd, fname, buildflags, NULL, NULL, NULL);
+}
+
 struct lcfs_node_s *lcfs_load_node_from_fd(int fd)
 {
 	struct lcfs_node_s *node;
@@ -720,12 +1549,12 @@ struct lcfs_node_s *lcfs_load_node_from_fd(int fd)
 
 int lcfs_node_set_payload(struct lcfs_node_s *node, const char *payload)
 {
-	char *dup = strdup(payload);
+	char *dup = lcfs_node_strdup(node, payload);
 	if (dup == NULL) {
 		errno = ENOMEM;
 		return -1;
 	}
-	free(node->payload);
+	lcfs_node_free(node, node->payload);
 	node->payload = dup;
 
 	return 0;
@@ -738,17 +1567,15 @@ const char *lcfs_node_get_payload(struct lcfs_node_s *node)
 
 const uint8_t *lcfs_node_get_fsverity_digest(struct lcfs_node_s *node)
 {
-	if (node->digest_set)
-		return node->digest;
-	return NULL;
+	return node->digest;
 }
 
-/* This is the sha256 fs-verity digest of the file contents */
+/* This is the sha256 fs-verity digest of the file contents.
+ * If this runs out of memory the digest is left unset. */
 void lcfs_node_set_fsverity_digest(struct lcfs_node_s *node,
 				   uint8_t digest[LCFS_DIGEST_SIZE])
 {
-	node->digest_set = true;
-	memcpy(node->digest, digest, LCFS_DIGEST_SIZE);
+	(void)lcfs_node_store_digest(node, digest);
 }
 
 int lcfs_node_set_content(struct lcfs_node_s *node, const uint8_t *data,
@@ -757,14 +1584,13 @@ int lcfs_node_set_content(struct lcfs_node_s *node, const uint8_t *data,
 	uint8_t *dup = NULL;
 
 	if (data && data_size != 0) {
-		dup = malloc(data_size);
+		dup = lcfs_node_memdup(node, data, data_size);
 		if (dup == NULL) {
 			errno = ENOMEM;
 			return -1;
 		}
-		memcpy(dup, data, data_size);
 	}
-	free(node->content);
+	lcfs_node_free(node, node->content);
 	node->content = dup;
 	node->inode.st_size = data_size;
 
@@ -854,7 +1680,7 @@ void lcfs_node_set_size(struct lcfs_node_s *node, uint64_t size)
 	if (size == node->inode.st_size)
 		return;
 
-	free(node->content);
+	lcfs_node_free(node, node->content);
 	node->content = NULL;
 	node->inode.st_size = size;
 }
@@ -871,10 +1697,74 @@ void lcfs_node_get_mtime(struct lcfs_node_s *node, struct timespec *time)
 	time->tv_nsec = node->inode.st_mtim_nsec;
 }
 
+/* Below this many children a linear scan is cheaper than the index */
+#define LCFS_CHILDREN_INDEX_MIN 16
+
+/* Counts are stored as uint32_t, and the index is up to four times
+ * as large as the number of children */
+#define LCFS_MAX_CHILDREN (UINT32_MAX / 4)
+
+static void lcfs_node_free_children_index(struct lcfs_node_s *node)
+{
+	free(node->children_index);
+	node->children_index = NULL;
+	node->children_index_size = 0;
+}
+
+static void children_index_insert(struct lcfs_node_s *node, size_t i)
+{
+	size_t mask = node->children_index_size - 1;
+	size_t pos = hash_string(node->children[i]->name, node->children_index_size);
+
+	while (node->children_index[pos] != 0)
+		pos = (pos + 1) & mask;
+	node->children_index[pos] = i + 1;
+}
+
+static int lcfs_node_build_children_index(struct lcfs_node_s *node)
+{
+	size_t size = 64;
+
+	/* Keep the load factor at most 1/2 */
+	while (size < node->children_size * 2)
+		size *= 2;
+
+	lcfs_node_free_children_index(node);
+	node->children_index = calloc(size, sizeof(uint32_t));
+	if (node->children_index == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	node->children_index_size = size;
+
+	for (size_t i = 0; i < node->children_size; i++)
+		children_index_insert(node, i);
+
+	return 0;
+}
+
 struct lcfs_node_s *lcfs_node_lookup_child(struct lcfs_node_s *node, const char *name)
 {
 	size_t i;
 
+	if (node->children_size >= LCFS_CHILDREN_INDEX_MIN &&
+	    (node->children_index != NULL ||
+	     lcfs_node_build_children_index(node) == 0)) {
+		size_t mask = node->children_index_size - 1;
+		size_t pos = hash_string(name, node->children_index_size);
+
+		for (; node->children_index[pos] != 0; pos = (pos + 1) & mask) {
+			struct lcfs_node_s *child =
+				node->children[node->children_index[pos] - 1];
+
+			if (strcmp(child->name, name) == 0)
+				return child;
+		}
+
+		return NULL;
+	}
+
+	/* Small directory, or out of memory for the index */
 	for (i = 0; i < node->children_size; ++i) {
 		struct lcfs_node_s *child = node->children[i];
 
@@ -902,10 +1792,54 @@ struct lcfs_node_s *lcfs_node_get_hardlink_target(struct lcfs_node_s *node)
 	return node->link_to;
 }
 
+/* Makes room for n_children children. Unless exact is set this grows
+ * geometrically, so adding children one by one is amortized O(1). */
+static int lcfs_node_grow_children(struct lcfs_node_s *node, size_t n_children,
+				   bool exact)
+{
+	struct lcfs_node_s **new_children;
+	size_t new_allocated;
+
+	if (n_children <= node->children_allocated)
+		return 0;
+
+	if (n_children > LCFS_MAX_CHILDREN) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	new_allocated = n_children;
+	if (!exact)
+		new_allocated = MIN(MAX(MAX(new_allocated, node->children_allocated * 2), 8),
+				    LCFS_MAX_CHILDREN);
+
+	new_children = reallocarray(node->children, sizeof(*node->children),
+				    new_allocated);
+	if (new_children == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	node->children = new_children;
+	node->children_allocated = new_allocated;
+
+	return 0;
+}
+
+/* For callers that know how many children a directory will get */
+int lcfs_node_reserve_children(struct lcfs_node_s *node, size_t n_children)
+{
+	if ((node->inode.st_mode & S_IFMT) != S_IFDIR) {
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	return lcfs_node_grow_children(node, n_children, true);
+}
+
 int lcfs_node_add_child(struct lcfs_node_s *parent, struct lcfs_node_s *child,
 			const char *name)
 {
-	struct lcfs_node_s **new_children;
 	size_t new_size;
 	char *name_copy;
 
@@ -930,7 +1864,7 @@ int lcfs_node_add_child(struct lcfs_node_s *parent, struct lcfs_node_s *child,
 		return -1;
 	}
 
-	name_copy = strdup(name);
+	name_copy = lcfs_node_strdup(child, name);
 	if (name_copy == NULL) {
 		errno = ENOMEM;
 		return -1;
@@ -938,21 +1872,25 @@ int lcfs_node_add_child(struct lcfs_node_s *parent, struct lcfs_node_s *child,
 
 	new_size = parent->children_size + 1;
 
-	new_children = reallocarray(parent->children, sizeof(*parent->children),
-				    new_size);
-	if (new_children == NULL) {
-		errno = ENOMEM;
-		free(name_copy);
+	if (lcfs_node_grow_children(parent, new_size, false) < 0) {
+		lcfs_node_free(child, name_copy);
 		return -1;
 	}
 
-	parent->children = new_children;
-
 	parent->children[parent->children_size] = child;
 	parent->children_size = new_size;
 	child->parent = parent;
 	child->name = name_copy;
 
+	/* Keep the index in sync, or drop it if it is too full, it is
+	 * rebuilt at twice the size on the next lookup */
+	if (parent->children_index != NULL) {
+		if (new_size * 2 <= parent->children_index_size)
+			children_index_insert(parent, new_size - 1);
+		else
+			lcfs_node_free_children_index(parent);
+	}
+
 	return 0;
 }
 
@@ -978,21 +1916,26 @@ void lcfs_node_unref(struct lcfs_node_s *node)
 
 	lcfs_node_remove_all_children(node);
 	free(node->children);
+	lcfs_node_free_children_index(node);
 
 	if (node->link_to)
 		lcfs_node_unref(node->link_to);
 
-	free(node->name);
-	free(node->payload);
-	free(node->content);
+	lcfs_node_free(node, node->name);
+	lcfs_node_free(node, node->payload);
+	lcfs_node_free(node, node->content);
+	lcfs_node_free(node, node->digest);
 
 	for (i = 0; i < node->n_xattrs; i++) {
-		free(node->xattrs[i].key);
-		free(node->xattrs[i].value);
+		lcfs_intern_unref(node->xattrs[i].key);
+		lcfs_intern_unref(node->xattrs[i].value);
 	}
 	free(node->xattrs);
 
-	free(node);
+	if (node->arena)
+		lcfs_arena_unref(node->arena);
+	else
+		free(node);
 }
 
 static void lcfs_node_remove_all_children(struct lcfs_node_s *node)
@@ -1001,12 +1944,13 @@ static void lcfs_node_remove_all_children(struct lcfs_node_s *node)
 		struct lcfs_node_s *child = node->children[i];
 		assert(child->parent == node);
 		/* Unlink correctly as it may live on outside the tree and be reinserted */
-		free(child->name);
+		lcfs_node_free(child, child->name);
 		child->name = NULL;
 		child->parent = NULL;
 		lcfs_node_destroy(child);
 	}
 	node->children_size = 0;
+	lcfs_node_free_children_index(node);
 }
 
 /* Unlink all children (recursively) and then unref. Useful to handle refcount loops like dot and dotdot. */
@@ -1048,24 +1992,23 @@ struct lcfs_node_s *lcfs_node_clone(struct lcfs_node_s *node)
 		new->xattrs = malloc(sizeof(struct lcfs_xattr_s) * node->n_xattrs);
 		if (new->xattrs == NULL)
 			return NULL;
+		new->xattrs_allocated = node->n_xattrs;
 		for (size_t i = 0; i < node->n_xattrs; i++) {
-			char *key = strdup(node->xattrs[i].key);
-			char *value = memdup(node->xattrs[i].value,
-					     node->xattrs[i].value_len);
-			if (key == NULL || value == NULL) {
-				free(key);
-				free(value);
-				return NULL;
-			}
-			new->xattrs[i].key = key;
-			new->xattrs[i].value = value;
+			new->xattrs[i].key = lcfs_intern_ref(node->xattrs[i].key);
+			new->xattrs[i].value =
+				lcfs_intern_ref(node->xattrs[i].value);
 			new->xattrs[i].value_len = node->xattrs[i].value_len;
 			new->n_xattrs++;
 		}
 	}
 
-	new->digest_set = node->digest_set;
-	memcpy(new->digest, node->digest, LCFS_DIGEST_SIZE);
+	if (node->digest) {
+		new->digest = (uint8_t *)memdup((char *)node->digest,
+					       LCFS_DIGEST_SIZE);
+		if (new->digest == NULL)
+			return NULL;
+	}
+
 	new->inode = node->inode;
 
 	return steal_pointer(&new);
@@ -1106,7 +2049,11 @@ static struct lcfs_node_s *_lcfs_node_clone_deep(struct lcfs_node_s *node,
 	data->mapping[data->n_mappings].new = new;
 	data->n_mappings++;
 
-	for (size_t i = 0; i < node->children_size; ++i) {
+	if (node->children_size > 0 &&
+	    lcfs_node_reserve_children(new, node->children_size) < 0)
+		return NULL;
+
+	for (size_t i = 0; i < node->children_size; ++i) {
 		struct lcfs_node_s *child = node->children[i];
 		struct lcfs_node_s *new_child = _lcfs_node_clone_deep(child, data);
 		if (new_child == NULL)
@@ -1158,8 +2105,237 @@ bool lcfs_node_dirp(struct lcfs_node_s *node)
 	return (node->inode.st_mode & S_IFMT) == S_IFDIR;
 }
 
-struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
-			       char **failed_path_out)
+/* A file with more than one link, seen before in the build */
+struct lcfs_hardlink_s {
+	dev_t dev;
+	ino_t ino;
+	struct lcfs_node_s *node; /* Owned by the tree */
+};
+
+/* Files with more than one link are only loaded once per build, the
+ * other paths to them become hardlinks to that node */
+struct lcfs_hardlinks_s {
+	Hash_table *table;
+	pthread_mutex_t lock; /* For lcfs_build_parallel() */
+};
+
+static size_t hardlinks_ht_hasher(const void *d, size_t n)
+{
+	const struct lcfs_hardlink_s *link = d;
+
+	return (link->dev * 31 + link->ino) % n;
+}
+
+static bool hardlinks_ht_comparator(const void *d1, const void *d2)
+{
+	const struct lcfs_hardlink_s *link1 = d1;
+	const struct lcfs_hardlink_s *link2 = d2;
+
+	return link1->dev == link2->dev && link1->ino == link2->ino;
+}
+
+static int lcfs_hardlinks_init(struct lcfs_hardlinks_s *links)
+{
+	links->table = hash_initialize(0, NULL, hardlinks_ht_hasher,
+				       hardlinks_ht_comparator, free);
+	if (links->table == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	pthread_mutex_init(&links->lock, NULL);
+
+	return 0;
+}
+
+static void lcfs_hardlinks_destroy(struct lcfs_hardlinks_s *links)
+{
+	hash_free(links->table);
+	pthread_mutex_destroy(&links->lock);
+}
+
+static bool lcfs_hardlinks_wanted(struct lcfs_hardlinks_s *links,
+				  const struct stat *sb)
+{
+	return links != NULL && !S_ISDIR(sb->st_mode) && sb->st_nlink > 1;
+}
+
+/* Called with links->lock held */
+static struct lcfs_node_s *lcfs_hardlinks_new_link(struct lcfs_node_s *target,
+						   lcfs_arena_t *arena)
+{
+	struct lcfs_node_s *link;
+
+	link = lcfs_node_new_in_arena(arena);
+	if (link == NULL)
+		return NULL;
+
+	link->inode.st_mode = target->inode.st_mode;
+	lcfs_node_make_hardlink(link, target);
+
+	return link;
+}
+
+/* Returns a new hardlink to the node already loaded for sb, or NULL
+ * with errno 0 if there is none */
+static struct lcfs_node_s *lcfs_hardlinks_lookup(struct lcfs_hardlinks_s *links,
+						 const struct stat *sb,
+						 lcfs_arena_t *arena)
+{
+	struct lcfs_hardlink_s key = { .dev = sb->st_dev, .ino = sb->st_ino };
+	const struct lcfs_hardlink_s *link;
+	struct lcfs_node_s *res = NULL;
+
+	errno = 0;
+
+	pthread_mutex_lock(&links->lock);
+	link = hash_lookup(links->table, &key);
+	if (link != NULL)
+		res = lcfs_hardlinks_new_link(link->node, arena);
+	pthread_mutex_unlock(&links->lock);
+
+	return res;
+}
+
+/* Records node as loaded for sb, and returns it. If another thread
+ * got there first node is dropped, and a hardlink to theirs is
+ * returned instead. */
+static struct lcfs_node_s *lcfs_hardlinks_insert(struct lcfs_hardlinks_s *links,
+						 const struct stat *sb,
+						 struct lcfs_node_s *node,
+						 lcfs_arena_t *arena)
+{
+	const void *matched = NULL;
+	struct lcfs_hardlink_s *link;
+	struct lcfs_node_s *res = node;
+	int r;
+
+	link = malloc(sizeof(struct lcfs_hardlink_s));
+	if (link == NULL) {
+		lcfs_node_unref(node);
+		errno = ENOMEM;
+		return NULL;
+	}
+	link->dev = sb->st_dev;
+	link->ino = sb->st_ino;
+	link->node = node;
+
+	pthread_mutex_lock(&links->lock);
+	r = hash_insert_if_absent(links->table, link, &matched);
+	if (r == 0)
+		res = lcfs_hardlinks_new_link(
+			((const struct lcfs_hardlink_s *)matched)->node, arena);
+	pthread_mutex_unlock(&links->lock);
+
+	if (r != 1) {
+		free(link);
+		lcfs_node_unref(node);
+		if (r < 0) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	return res;
+}
+
+/* Like lcfs_load_node_with_stat(), but files with more than one link
+ * are only loaded the first time they are seen. Hardlinks to them
+ * are returned after that. */
+static struct lcfs_node_s *lcfs_load_node_or_link(struct lcfs_hardlinks_s *links,
+						  int dirfd, const char *fname,
+						  const struct stat *sb,
+						  int buildflags,
+						  struct lcfs_digest_cache_s *cache,
+						  lcfs_arena_t *arena,
+						  struct lcfs_build_stats_s *stats)
+{
+	struct lcfs_node_s *node;
+
+	if (!lcfs_hardlinks_wanted(links, sb))
+		return lcfs_load_node_with_stat(dirfd, fname, sb, buildflags,
+						cache, arena, stats);
+
+	node = lcfs_hardlinks_lookup(links, sb, arena);
+	if (node != NULL || errno != 0)
+		return node;
+
+	node = lcfs_load_node_with_stat(dirfd, fname, sb, buildflags, cache,
+					arena, stats);
+	if (node == NULL)
+		return NULL;
+
+	return lcfs_hardlinks_insert(links, sb, node, arena);
+}
+
+/* Swaps the places of two non-directory nodes in the tree */
+static void lcfs_node_swap_places(struct lcfs_node_s *a, size_t a_index,
+				  struct lcfs_node_s *b)
+{
+	struct lcfs_node_s *a_parent = a->parent;
+	struct lcfs_node_s *b_parent = b->parent;
+	char *a_name = a->name;
+	size_t b_index = 0;
+
+	while (b_parent->children[b_index] != b)
+		b_index++;
+
+	a_parent->children[a_index] = b;
+	b_parent->children[b_index] = a;
+	a->parent = b_parent;
+	b->parent = a_parent;
+	a->name = b->name;
+	b->name = a_name;
+}
+
+static void lcfs_hardlinks_reorder_walk(struct lcfs_node_s *node)
+{
+	for (size_t i = 0; i < node->children_size; i++) {
+		struct lcfs_node_s *child = node->children[i];
+		struct lcfs_node_s *target = child->link_to;
+
+		if (lcfs_node_dirp(child)) {
+			lcfs_hardlinks_reorder_walk(child);
+		} else if (target == NULL) {
+			/* Only nodes that are hardlinked to have more links */
+			if (child->inode.st_nlink > 1)
+				child->in_tree = true;
+		} else if (!target->in_tree) {
+			lcfs_node_swap_places(child, i, target);
+			target->in_tree = true;
+		}
+	}
+}
+
+/* The builders that don't load files in lcfs_build_serial() order
+ * may have loaded a later path to a file, and hardlinked the earlier
+ * ones. This makes the first path the loaded node, so the image
+ * doesn't depend on the order the builder got to them in. */
+static void lcfs_hardlinks_reorder(struct lcfs_hardlinks_s *links,
+				   struct lcfs_node_s *root)
+{
+	struct lcfs_hardlink_s *link;
+
+	if (links == NULL || hash_get_n_entries(links->table) == 0 ||
+	    !lcfs_node_dirp(root))
+		return;
+
+	/* in_tree marks the loaded nodes that were already seen, it is
+	 * reset for compute_tree() */
+	lcfs_hardlinks_reorder_walk(root);
+
+	for (link = hash_get_first(links->table); link != NULL;
+	     link = hash_get_next(links->table, link))
+		link->node->in_tree = false;
+}
+
+/* sb is the result of lcfs_stat() for fname, if the caller has it */
+static struct lcfs_node_s *lcfs_build_serial(int dirfd, const char *fname,
+					     const struct stat *sb, int buildflags,
+					     struct lcfs_digest_cache_s *cache,
+					     lcfs_arena_t *arena,
+					     struct lcfs_build_stats_s *stats,
+					     struct lcfs_hardlinks_s *links,
+					     char **failed_path_out)
 {
 	struct lcfs_node_s *node = NULL;
 	struct dirent *de;
@@ -1169,7 +2345,12 @@ struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
 	const char *failed_subpath = NULL;
 	int errsv;
 
-	node = lcfs_load_node_from_file(dirfd, fname, buildflags);
+	if (sb != NULL)
+		node = lcfs_load_node_with_stat(dirfd, fname, sb, buildflags,
+						cache, arena, stats);
+	else
+		node = lcfs_load_node(dirfd, fname, buildflags, cache, arena,
+				      stats);
 	if (node == NULL) {
 		errsv = errno;
 		goto fail;
@@ -1194,6 +2375,7 @@ struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
 
 	for (;;) {
 		struct lcfs_node_s *n;
+		struct stat statbuf;
 		int r;
 
 		errno = 0;
@@ -1210,23 +2392,19 @@ struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
 		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
 			continue;
 
-		if (de->d_type == DT_UNKNOWN) {
-			struct stat statbuf;
-
-			if (fstatat(dfd, de->d_name, &statbuf,
-				    AT_SYMLINK_NOFOLLOW) < 0) {
-				errsv = errno;
-				failed_subpath = de->d_name;
-				goto fail;
-			}
-
-			if (S_ISDIR(statbuf.st_mode))
-				de->d_type = DT_DIR;
+		/* Every entry is loaded, so it is stat:ed anyway, and that
+		 * is used instead of d_type (which may be DT_UNKNOWN) */
+		if (lcfs_stat(dfd, de->d_name, buildflags, cache, stats,
+			      &statbuf) < 0) {
+			errsv = errno;
+			failed_subpath = de->d_name;
+			goto fail;
 		}
 
-		if (de->d_type == DT_DIR) {
-			n = lcfs_build(dfd, de->d_name, buildflags,
-				       &free_failed_subpath);
+		if (S_ISDIR(statbuf.st_mode)) {
+			n = lcfs_build_serial(dfd, de->d_name, &statbuf,
+					      buildflags, cache, arena, stats,
+					      links, &free_failed_subpath);
 			if (n == NULL) {
 				failed_subpath = free_failed_subpath;
 				errsv = errno;
@@ -1234,11 +2412,14 @@ struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
 			}
 		} else {
 			if (buildflags & LCFS_BUILD_SKIP_DEVICES) {
-				if (de->d_type == DT_BLK || de->d_type == DT_CHR)
+				if (S_ISBLK(statbuf.st_mode) ||
+				    S_ISCHR(statbuf.st_mode))
 					continue;
 			}
 
-			n = lcfs_load_node_from_file(dfd, de->d_name, buildflags);
+			n = lcfs_load_node_or_link(links, dfd, de->d_name,
+						   &statbuf, buildflags, cache,
+						   arena, stats);
 			if (n == NULL) {
 				errsv = errno;
 				failed_subpath = de->d_name;
@@ -1269,130 +2450,1162 @@ fail:
 	return NULL;
 }
 
-size_t lcfs_node_get_n_xattr(struct lcfs_node_s *node)
+struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
+			       char **failed_path_out)
 {
-	return node->n_xattrs;
+	struct lcfs_build_options_s options = { .flags = buildflags };
+
+	return lcfs_build_with_options(dirfd, fname, &options, failed_path_out);
 }
 
-const char *lcfs_node_get_xattr_name(struct lcfs_node_s *node, size_t index)
-{
-	if (index >= node->n_xattrs)
-		return NULL;
+struct lcfs_build_ctx_s {
+	int dirfd;
+	int buildflags;
+	int load_flags; /* buildflags without the digest flags */
+	struct lcfs_digest_cache_s *digest_cache;
+	lcfs_arena_t *arena;
+	struct lcfs_build_stats_s *stats;
+	struct lcfs_hardlinks_s *links;
+	lcfs_pool_t *pool;
 
-	return node->xattrs[index].key;
-}
+	atomic_bool failed;
+	pthread_mutex_t error_lock;
+	int errsv;
+	char *failed_path;
+};
 
-static ssize_t find_xattr(struct lcfs_node_s *node, const char *name)
+/* An open source directory. Tasks for its entries open them relative
+ * to it, rather than by path from ctx->dirfd, so paths can't get too
+ * long and a directory can't be swapped for a symlink in the middle of
+ * the build. It is closed when the last of those tasks is done. */
+struct lcfs_build_dir_s {
+	DIR *dir;
+	char *path; /* Relative to ctx->dirfd, only for errors */
+	atomic_size_t refs;
+};
+
+struct lcfs_build_dir_task_s {
+	struct lcfs_build_ctx_s *ctx;
+	struct lcfs_node_s *node; /* Owned by the tree */
+	struct lcfs_build_dir_s *parent; /* NULL for the root */
+	const char *name; /* Owned by node, or the root fname */
+};
+
+/* Only the first error is recorded, like the serial build which stops at the first failure */
+static void lcfs_build_ctx_set_error(struct lcfs_build_ctx_s *ctx, int errsv,
+				     const char *path, const char *subpath)
 {
-	ssize_t i;
-	for (i = 0; i < (ssize_t)node->n_xattrs; i++) {
-		struct lcfs_xattr_s *xattr = &node->xattrs[i];
-		if (strcmp(name, xattr->key) == 0)
-			return i;
+	pthread_mutex_lock(&ctx->error_lock);
+	if (!atomic_load(&ctx->failed)) {
+		ctx->errsv = errsv;
+		ctx->failed_path = maybe_join_path(path, subpath);
+		atomic_store(&ctx->failed, true);
 	}
-	return -1;
+	pthread_mutex_unlock(&ctx->error_lock);
 }
 
-const char *lcfs_node_get_xattr(struct lcfs_node_s *node, const char *name,
-				size_t *length)
+static struct lcfs_build_dir_s *lcfs_build_dir_ref(struct lcfs_build_dir_s *dir)
 {
-	ssize_t index = find_xattr(node, name);
+	atomic_fetch_add(&dir->refs, 1);
+	return dir;
+}
 
-	if (index >= 0) {
-		struct lcfs_xattr_s *xattr = &node->xattrs[index];
-		if (length)
-			*length = xattr->value_len;
-		return xattr->value;
-	}
+static void lcfs_build_dir_unref(struct lcfs_build_dir_s *dir)
+{
+	if (dir == NULL || atomic_fetch_sub(&dir->refs, 1) != 1)
+		return;
 
-	return NULL;
+	closedir(dir->dir);
+	free(dir->path);
+	free(dir);
 }
 
-int lcfs_node_unset_xattr(struct lcfs_node_s *node, const char *name)
+struct lcfs_build_digest_task_s {
+	struct lcfs_build_ctx_s *ctx;
+	struct lcfs_node_s *node; /* Owned by the tree */
+	struct lcfs_build_dir_s *parent;
+};
+
+static void lcfs_build_digest_task(void *data)
 {
-	ssize_t index = find_xattr(node, name);
+	cleanup_free struct lcfs_build_digest_task_s *task = data;
+	struct lcfs_build_ctx_s *ctx = task->ctx;
+	struct lcfs_build_dir_s *parent = task->parent;
+	const char *name = lcfs_node_get_name(task->node);
+	cleanup_fd int fd = -1;
+	int digest_flags;
 
-	if (index >= 0) {
-		if (index != (ssize_t)node->n_xattrs - 1)
-			node->xattrs[index] = node->xattrs[node->n_xattrs - 1];
-		node->n_xattrs--;
+	if (atomic_load(&ctx->failed))
+		goto out;
+
+	/* The open and its close */
+	lcfs_count_syscalls(ctx->stats, 2);
+
+	fd = openat(dirfd(parent->dir), name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		lcfs_build_ctx_set_error(ctx, errno, parent->path, name);
+		goto out;
 	}
 
-	return -1;
+	/* Like lcfs_load_node(), never lazy for inline files */
+	digest_flags = ctx->buildflags;
+	if (task->node->content != NULL)
+		digest_flags &= ~LCFS_BUILD_LAZY_DIGEST;
+
+	if (lcfs_node_set_digest_from_fd(task->node, fd, NULL, digest_flags,
+					 ctx->digest_cache, ctx->stats) < 0)
+		lcfs_build_ctx_set_error(ctx, errno, parent->path, name);
+
+out:
+	lcfs_build_dir_unref(parent);
 }
 
-int lcfs_node_set_xattr(struct lcfs_node_s *node, const char *name,
-			const char *value, size_t value_len)
+/* Hashing file content is the expensive part of a build, so instead
+ * of doing it while loading the node it is queued as a separate task
+ * that can run in parallel with the rest of the scan. */
+static int lcfs_build_push_digest(struct lcfs_build_ctx_s *ctx,
+				  struct lcfs_node_s *node,
+				  struct lcfs_build_dir_s *parent)
 {
-	struct lcfs_xattr_s *xattrs;
-	char *k, *v;
-	ssize_t index = find_xattr(node, name);
+	struct lcfs_build_digest_task_s *task;
 
-	if (value_len > UINT16_MAX) {
-		errno = EINVAL;
+	task = calloc(1, sizeof(struct lcfs_build_digest_task_s));
+	if (task == NULL) {
+		errno = ENOMEM;
 		return -1;
 	}
 
-	if (index >= 0) {
-		/* Already set, replace */
-		struct lcfs_xattr_s *xattr = &node->xattrs[index];
-		v = memdup(value, value_len);
-		if (v == NULL) {
-			errno = ENOMEM;
-			return -1;
-		}
-		free(xattr->value);
-		xattr->value = v;
-		xattr->value_len = value_len;
+	task->ctx = ctx;
+	task->node = node;
+	task->parent = lcfs_build_dir_ref(parent);
 
-		return 0;
+	if (lcfs_pool_push(ctx->pool, lcfs_build_digest_task, task) < 0) {
+		lcfs_build_dir_unref(parent);
+		free(task);
+		return -1;
 	}
 
-	xattrs = realloc(node->xattrs,
-			 (node->n_xattrs + 1) * sizeof(struct lcfs_xattr_s));
-	if (xattrs == NULL) {
+	return 0;
+}
+
+static bool lcfs_build_needs_digest(struct lcfs_build_ctx_s *ctx,
+				    struct lcfs_node_s *node)
+{
+	return (node->inode.st_mode & S_IFMT) == S_IFREG &&
+	       node->link_to == NULL && node->inode.st_size > 0 &&
+	       (ctx->buildflags &
+		(LCFS_BUILD_COMPUTE_DIGEST | LCFS_BUILD_BY_DIGEST)) != 0;
+}
+
+static void lcfs_build_dir_task(void *data);
+
+static int lcfs_build_push_dir(struct lcfs_build_ctx_s *ctx,
+			       struct lcfs_node_s *node,
+			       struct lcfs_build_dir_s *parent, const char *name)
+{
+	struct lcfs_build_dir_task_s *task;
+
+	task = calloc(1, sizeof(struct lcfs_build_dir_task_s));
+	if (task == NULL) {
 		errno = ENOMEM;
 		return -1;
 	}
-	node->xattrs = xattrs;
 
-	k = strdup(name);
-	v = memdup(value, value_len);
-	if (k == NULL || v == NULL) {
-		free(k);
-		free(v);
-		errno = ENOMEM;
+	task->ctx = ctx;
+	task->node = node;
+	task->parent = parent ? lcfs_build_dir_ref(parent) : NULL;
+	task->name = name;
+
+	if (lcfs_pool_push(ctx->pool, lcfs_build_dir_task, task) < 0) {
+		lcfs_build_dir_unref(parent);
+		free(task);
 		return -1;
 	}
 
-	xattrs[node->n_xattrs].key = k;
-	xattrs[node->n_xattrs].value = v;
-	xattrs[node->n_xattrs].value_len = value_len;
-	node->n_xattrs++;
-
 	return 0;
 }
 
-/* This is an internal function.
- * Be careful to not cause duplicates if new_name already exist */
-int lcfs_node_rename_xattr(struct lcfs_node_s *node, size_t index, const char *new_name)
+/* Reads the entries of one directory. Subdirectories are added to the
+ * tree right away (so the children keep readdir order, like the serial
+ * build) but their contents are read by separate tasks, and the same
+ * goes for the digests of regular files. Each node is only ever modified
+ * by one task at a time. */
+static void lcfs_build_dir_task(void *data)
 {
-	struct lcfs_xattr_s *xattr;
-	cleanup_free char *dup = NULL;
+	cleanup_free struct lcfs_build_dir_task_s *task = data;
+	struct lcfs_build_ctx_s *ctx = task->ctx;
+	struct lcfs_build_dir_s *parent = task->parent;
+	struct lcfs_node_s *node = task->node;
+	struct lcfs_build_dir_s *self = NULL;
+	const char *failed_subpath = NULL;
+	cleanup_free char *path = NULL;
+	struct dirent *de;
+	int dfd;
+	int errsv;
 
-	dup = strdup(new_name);
-	if (dup == NULL) {
-		errno = ENOMEM;
-		return -1;
+	if (atomic_load(&ctx->failed))
+		goto out;
+
+	if (parent)
+		path = maybe_join_path(parent->path, task->name);
+	else
+		path = maybe_join_path(task->name, NULL);
+	if (path == NULL) {
+		errsv = ENOMEM;
+		goto fail;
 	}
 
-	if (index >= node->n_xattrs) {
-		errno = EINVAL;
+	dfd = openat(parent ? dirfd(parent->dir) : ctx->dirfd, task->name,
+		     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC, 0);
+	if (dfd < 0) {
+		errsv = errno;
+		goto fail;
+	}
+
+	self = calloc(1, sizeof(struct lcfs_build_dir_s));
+	if (self == NULL) {
+		errsv = ENOMEM;
+		close(dfd);
+		goto fail;
+	}
+	atomic_init(&self->refs, 1);
+
+	self->dir = fdopendir(dfd);
+	if (self->dir == NULL) {
+		errsv = errno;
+		close(dfd);
+		free(self);
+		self = NULL;
+		goto fail;
+	}
+
+	self->path = steal_pointer(&path);
+
+	for (;;) {
+		struct lcfs_node_s *n;
+		struct stat statbuf;
+		bool is_dir;
+		int r;
+
+		if (atomic_load(&ctx->failed))
+			break;
+
+		errno = 0;
+		de = readdir(self->dir);
+		if (de == NULL) {
+			if (errno) {
+				errsv = errno;
+				goto fail;
+			}
+
+			break;
+		}
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		/* Like lcfs_build_serial(), the same stat is used to
+		 * load the node. The digest cache is only used by the
+		 * digest tasks, which stat the open file. */
+		if (lcfs_stat(dfd, de->d_name, ctx->load_flags, NULL, ctx->stats,
+			      &statbuf) < 0) {
+			errsv = errno;
+			failed_subpath = de->d_name;
+			goto fail;
+		}
+
+		if (ctx->buildflags & LCFS_BUILD_SKIP_DEVICES) {
+			if (S_ISBLK(statbuf.st_mode) || S_ISCHR(statbuf.st_mode))
+				continue;
+		}
+
+		n = lcfs_load_node_or_link(ctx->links, dfd, de->d_name, &statbuf,
+					   ctx->load_flags, NULL, ctx->arena,
+					   ctx->stats);
+		if (n == NULL) {
+			errsv = errno;
+			failed_subpath = de->d_name;
+			goto fail;
+		}
+
+		is_dir = S_ISDIR(statbuf.st_mode);
+
+		r = lcfs_node_add_child(node, n, de->d_name);
+		if (r < 0) {
+			errsv = errno;
+			lcfs_node_unref(n);
+			goto fail;
+		}
+
+		/* The tasks use the name owned by the node, de->d_name
+		 * is only valid until the next readdir() */
+		if (is_dir)
+			r = lcfs_build_push_dir(ctx, n, self, lcfs_node_get_name(n));
+		else if (lcfs_build_needs_digest(ctx, n))
+			r = lcfs_build_push_digest(ctx, n, self);
+		if (r < 0) {
+			errsv = errno;
+			goto fail;
+		}
+	}
+
+	goto out;
+
+fail:
+	lcfs_build_ctx_set_error(ctx, errsv, self ? self->path : path,
+				 failed_subpath);
+out:
+	lcfs_build_dir_unref(self);
+	lcfs_build_dir_unref(parent);
+}
+
+static struct lcfs_node_s *lcfs_build_parallel(int dirfd, const char *fname,
+					       int buildflags, size_t n_threads,
+					       struct lcfs_digest_cache_s *cache,
+					       lcfs_arena_t *arena,
+					       struct lcfs_build_stats_s *stats,
+					       struct lcfs_hardlinks_s *links,
+					       char **failed_path_out)
+{
+	struct lcfs_build_ctx_s ctx = {
+		.dirfd = dirfd,
+		.buildflags = buildflags,
+		.load_flags = buildflags & ~(LCFS_BUILD_COMPUTE_DIGEST |
+					     LCFS_BUILD_BY_DIGEST),
+		.digest_cache = cache,
+		.arena = arena,
+		.stats = stats,
+		.links = links,
+	};
+	cleanup_node struct lcfs_node_s *root = NULL;
+	int errsv;
+
+	root = lcfs_load_node(dirfd, fname, buildflags, cache, arena, stats);
+	if (root == NULL) {
+		errsv = errno;
+		if (failed_path_out)
+			*failed_path_out = maybe_join_path(fname, NULL);
+		errno = errsv;
+		return NULL;
+	}
+
+	if (!lcfs_node_dirp(root))
+		return steal_pointer(&root);
+
+	ctx.pool = lcfs_pool_new(n_threads);
+	if (ctx.pool == NULL) {
+		errsv = errno;
+		if (failed_path_out)
+			*failed_path_out = maybe_join_path(fname, NULL);
+		errno = errsv;
+		return NULL;
+	}
+	pthread_mutex_init(&ctx.error_lock, NULL);
+
+	if (lcfs_build_push_dir(&ctx, root, NULL, fname) < 0)
+		lcfs_build_ctx_set_error(&ctx, errno, fname, NULL);
+
+	lcfs_pool_wait(ctx.pool);
+	lcfs_pool_free(ctx.pool);
+	pthread_mutex_destroy(&ctx.error_lock);
+
+	if (atomic_load(&ctx.failed)) {
+		if (failed_path_out)
+			*failed_path_out = steal_pointer(&ctx.failed_path);
+		free(ctx.failed_path);
+		errno = ctx.errsv;
+		return NULL;
+	}
+
+	lcfs_hardlinks_reorder(links, root);
+
+	return steal_pointer(&root);
+}
+
+#ifdef HAVE_IO_URING
+
+/* Requests in flight in lcfs_build_uring(), and files read at a time */
+#define URING_QUEUE_DEPTH 128
+#define URING_MAX_FILES 64
+
+enum lcfs_uring_file_state_t {
+	URING_FILE_FREE,
+	URING_FILE_OPENING,
+	URING_FILE_READING,
+	URING_FILE_CLOSING,
+};
+
+/* A regular file whose content (for the digest or inlining) is read
+ * through the ring. Each file has at most one request in flight. */
+struct lcfs_uring_file_s {
+	enum lcfs_uring_file_state_t state;
+	struct lcfs_node_s *node; /* Owned by the tree */
+	const char *name; /* Owned by the directory being read */
+	struct stat sb;
+	int fd;
+	bool do_digest;
+	bool do_inline;
+	uint64_t offset;
+	FsVerityContext *fsverity_ctx; /* If the digest is computed */
+	uint8_t *buffer;
+	uint8_t content[LCFS_BUILD_INLINE_FILE_SIZE_LIMIT];
+};
+
+struct lcfs_uring_build_s {
+	lcfs_uring_t *ring;
+	int buildflags;
+	int load_flags; /* Without digests and inline content, read by the ring */
+	struct lcfs_digest_cache_s *digest_cache;
+	lcfs_arena_t *arena;
+	struct lcfs_build_stats_s *stats;
+	struct lcfs_hardlinks_s *links;
+	struct lcfs_uring_file_s files[URING_MAX_FILES];
+
+	bool failed;
+	int errsv;
+	char *failed_name; /* Relative to the directory being read */
+};
+
+struct lcfs_uring_dirent_s {
+	char *name;
+	struct statx stx;
+	struct lcfs_node_s *node; /* Set for directories */
+};
+
+static void lcfs_uring_build_set_error(struct lcfs_uring_build_s *ctx,
+				       int errsv, const char *name)
+{
+	if (!ctx->failed) {
+		ctx->failed = true;
+		ctx->errsv = errsv;
+		ctx->failed_name = name ? strdup(name) : NULL;
+	}
+}
+
+static void lcfs_uring_file_close(struct lcfs_uring_build_s *ctx,
+				  struct lcfs_uring_file_s *file)
+{
+	if (file->fsverity_ctx) {
+		lcfs_fsverity_context_free(file->fsverity_ctx);
+		file->fsverity_ctx = NULL;
+	}
+
+	/* Can't fail, every file has at most one request in flight */
+	if (lcfs_uring_prep_close(ctx->ring, file->fd, file - ctx->files) < 0)
+		close(file->fd);
+	file->state = URING_FILE_CLOSING;
+}
+
+static void lcfs_uring_file_fail(struct lcfs_uring_build_s *ctx,
+				 struct lcfs_uring_file_s *file, int errsv)
+{
+	lcfs_uring_build_set_error(ctx, errsv, file->name);
+	lcfs_uring_file_close(ctx, file);
+}
+
+static void lcfs_uring_file_read(struct lcfs_uring_build_s *ctx,
+				 struct lcfs_uring_file_s *file)
+{
+	if (lcfs_uring_prep_read(ctx->ring, file->fd, file->buffer,
+				 FSVERITY_READ_BUFFER_SIZE, file->offset,
+				 file - ctx->files) < 0) {
+		lcfs_uring_file_fail(ctx, file, errno);
+		return;
+	}
+	file->state = URING_FILE_READING;
+}
+
+/* Like lcfs_node_set_digest_from_fd() and the inlining in
+ * lcfs_load_node_with_stat(), once the file is open */
+static void lcfs_uring_file_opened(struct lcfs_uring_build_s *ctx,
+				   struct lcfs_uring_file_s *file)
+{
+	if (file->do_digest) {
+		bool lazy_digest = (ctx->buildflags & LCFS_BUILD_LAZY_DIGEST) != 0 &&
+				   !file->do_inline;
+		uint8_t digest[LCFS_DIGEST_SIZE];
+
+		if (lcfs_lookup_digest(file->fd, &file->sb, ctx->buildflags,
+				       ctx->digest_cache, ctx->stats, digest)) {
+			if (lcfs_node_apply_digest(file->node, digest,
+						   ctx->buildflags) < 0) {
+				lcfs_uring_file_fail(ctx, file, errno);
+				return;
+			}
+		} else if (!lazy_digest) {
+			file->fsverity_ctx = lcfs_fsverity_context_new();
+			if (file->fsverity_ctx == NULL) {
+				lcfs_uring_file_fail(ctx, file, ENOMEM);
+				return;
+			}
+		}
+	}
+
+	if (file->fsverity_ctx == NULL && !file->do_inline) {
+		lcfs_uring_file_close(ctx, file);
+		return;
+	}
+
+	if (file->buffer == NULL) {
+		file->buffer = malloc(FSVERITY_READ_BUFFER_SIZE);
+		if (file->buffer == NULL) {
+			lcfs_uring_file_fail(ctx, file, ENOMEM);
+			return;
+		}
+	}
+
+	lcfs_uring_file_read(ctx, file);
+}
+
+static void lcfs_uring_file_done(struct lcfs_uring_build_s *ctx,
+				 struct lcfs_uring_file_s *file)
+{
+	if (file->fsverity_ctx) {
+		uint8_t digest[LCFS_DIGEST_SIZE];
+
+		lcfs_fsverity_context_get_digest(file->fsverity_ctx, digest);
+
+		if (ctx->digest_cache != NULL &&
+		    lcfs_digest_cache_insert(ctx->digest_cache, &file->sb, digest) < 0) {
+			lcfs_uring_file_fail(ctx, file, errno);
+			return;
+		}
+
+		if (lcfs_node_apply_digest(file->node, digest, ctx->buildflags) < 0) {
+			lcfs_uring_file_fail(ctx, file, errno);
+			return;
+		}
+	}
+
+	if (file->do_inline) {
+		if (file->offset < (uint64_t)file->sb.st_size) {
+			lcfs_uring_file_fail(ctx, file, ENODATA);
+			return;
+		}
+
+		if (lcfs_node_set_content(file->node, file->content,
+					  file->sb.st_size) < 0) {
+			lcfs_uring_file_fail(ctx, file, errno);
+			return;
+		}
+	}
+
+	lcfs_uring_file_close(ctx, file);
+}
+
+static void lcfs_uring_file_complete(struct lcfs_uring_build_s *ctx,
+				     struct lcfs_uring_file_s *file, int32_t res)
+{
+	uint64_t size = file->sb.st_size;
+
+	switch (file->state) {
+	case URING_FILE_OPENING:
+		if (res < 0) {
+			lcfs_uring_build_set_error(ctx, -res, file->name);
+			file->state = URING_FILE_FREE;
+			return;
+		}
+
+		file->fd = res;
+		if (ctx->failed)
+			lcfs_uring_file_close(ctx, file);
+		else
+			lcfs_uring_file_opened(ctx, file);
+		break;
+
+	case URING_FILE_READING:
+		if (res < 0) {
+			/* Like lcfs_compute_fsverity_from_content() */
+			lcfs_uring_file_fail(ctx, file,
+					     file->fsverity_ctx ? ENODATA : -res);
+			return;
+		}
+
+		if (ctx->failed) {
+			lcfs_uring_file_close(ctx, file);
+			return;
+		}
+
+		if (res == 0) {
+			lcfs_uring_file_done(ctx, file);
+			return;
+		}
+
+		if (file->fsverity_ctx)
+			lcfs_fsverity_context_update(file->fsverity_ctx,
+						     file->buffer, res);
+		if (file->do_inline && file->offset < size)
+			memcpy(file->content + file->offset, file->buffer,
+			       MIN((uint64_t)res, size - file->offset));
+		file->offset += res;
+
+		/* The digest needs the whole file, inlining only st_size */
+		if (file->fsverity_ctx == NULL && file->offset >= size)
+			lcfs_uring_file_done(ctx, file);
+		else
+			lcfs_uring_file_read(ctx, file);
+		break;
+
+	case URING_FILE_CLOSING:
+		file->state = URING_FILE_FREE;
+		break;
+
+	case URING_FILE_FREE:
+		assert(false);
+		break;
+	}
+}
+
+/* Submits the prepared requests and handles at least one completion */
+static int lcfs_uring_build_wait(struct lcfs_uring_build_s *ctx)
+{
+	uint64_t user_data;
+	int32_t res;
+
+	lcfs_count_syscalls(ctx->stats, 1);
+
+	if (lcfs_uring_submit(ctx->ring, 1) < 0)
+		return -1;
+
+	while (lcfs_uring_get_completion(ctx->ring, &user_data, &res))
+		lcfs_uring_file_complete(ctx, &ctx->files[user_data], res);
+
+	return 0;
+}
+
+/* Waits for all files to be read, also after errors, as the requests
+ * refer to the directory and its entries */
+static int lcfs_uring_build_drain(struct lcfs_uring_build_s *ctx)
+{
+	while (lcfs_uring_get_in_flight(ctx->ring) > 0) {
+		if (lcfs_uring_build_wait(ctx) < 0) {
+			lcfs_uring_build_set_error(ctx, errno, NULL);
+			return -1;
+		}
+	}
+
+	if (ctx->failed) {
+		errno = ctx->errsv;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lcfs_uring_build_add_file(struct lcfs_uring_build_s *ctx, int dfd,
+				     const char *name, const struct stat *sb,
+				     struct lcfs_node_s *node)
+{
+	bool no_inline = (ctx->buildflags & LCFS_BUILD_NO_INLINE) != 0;
+	struct lcfs_uring_file_s *file = NULL;
+
+	while (file == NULL) {
+		for (size_t i = 0; i < URING_MAX_FILES; i++) {
+			if (ctx->files[i].state == URING_FILE_FREE) {
+				file = &ctx->files[i];
+				break;
+			}
+		}
+
+		if (file == NULL && lcfs_uring_build_wait(ctx) < 0)
+			return -1;
+		if (ctx->failed)
+			return 0; /* Reported by lcfs_uring_build_drain() */
+	}
+
+	file->node = node;
+	file->name = name;
+	file->sb = *sb;
+	file->fd = -1;
+	file->offset = 0;
+	file->do_digest = (ctx->buildflags & (LCFS_BUILD_COMPUTE_DIGEST |
+					      LCFS_BUILD_BY_DIGEST)) != 0;
+	file->do_inline = !no_inline &&
+			  sb->st_size <= LCFS_BUILD_INLINE_FILE_SIZE_LIMIT;
+
+	if (lcfs_uring_prep_openat(ctx->ring, dfd, name, O_RDONLY | O_CLOEXEC,
+				   file - ctx->files) < 0)
+		return -1;
+	file->state = URING_FILE_OPENING;
+
+	return 0;
+}
+
+/* Stats all entries of a directory, with up to URING_QUEUE_DEPTH
+ * requests in flight */
+static int lcfs_uring_build_statx(struct lcfs_uring_build_s *ctx, int dfd,
+				  struct lcfs_uring_dirent_s *entries,
+				  size_t n_entries, const char **failed_name)
+{
+	unsigned int mask = lcfs_statx_mask(ctx->digest_cache);
+	int flags = lcfs_statx_flags(ctx->buildflags);
+	size_t next = 0;
+	int errsv = 0;
+
+	while (next < n_entries || lcfs_uring_get_in_flight(ctx->ring) > 0) {
+		uint64_t user_data;
+		int32_t res;
+
+		while (next < n_entries && errsv == 0 &&
+		       lcfs_uring_prep_statx(ctx->ring, dfd, entries[next].name,
+					     flags, mask, &entries[next].stx,
+					     next) == 0)
+			next++;
+
+		if (errsv != 0 && lcfs_uring_get_in_flight(ctx->ring) == 0)
+			break;
+
+		lcfs_count_syscalls(ctx->stats, 1);
+
+		if (lcfs_uring_submit(ctx->ring, 1) < 0)
+			return -1;
+
+		while (lcfs_uring_get_completion(ctx->ring, &user_data, &res)) {
+			if (res < 0 && errsv == 0) {
+				errsv = -res;
+				*failed_name = entries[user_data].name;
+			}
+		}
+	}
+
+	if (errsv != 0) {
+		errno = errsv;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Like lcfs_build_serial() for the children of node, but the entries
+ * of each directory are stat:ed, and their content read, through the
+ * ring, many at a time. */
+static int lcfs_uring_build_dir(struct lcfs_uring_build_s *ctx,
+				struct lcfs_node_s *node, int dirfd,
+				const char *fname, char **failed_path_out)
+{
+	struct lcfs_uring_dirent_s *entries = NULL;
+	size_t n_entries = 0;
+	size_t allocated_entries = 0;
+	char *free_failed_subpath = NULL;
+	const char *failed_subpath = NULL;
+	struct dirent *de;
+	DIR *dir = NULL;
+	int dfd;
+	int errsv;
+	int r;
+
+	dfd = openat(dirfd, fname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0);
+	if (dfd < 0) {
+		errsv = errno;
+		goto fail;
+	}
+
+	dir = fdopendir(dfd);
+	if (dir == NULL) {
+		errsv = errno;
+		close(dfd);
+		goto fail;
+	}
+
+	for (;;) {
+		errno = 0;
+		de = readdir(dir);
+		if (de == NULL) {
+			if (errno) {
+				errsv = errno;
+				goto fail;
+			}
+
+			break;
+		}
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (n_entries == allocated_entries) {
+			size_t new_allocated = MAX(allocated_entries * 2, 64);
+			struct lcfs_uring_dirent_s *new_entries =
+				reallocarray(entries, new_allocated,
+					     sizeof(struct lcfs_uring_dirent_s));
+			if (new_entries == NULL) {
+				errsv = ENOMEM;
+				goto fail;
+			}
+			entries = new_entries;
+			allocated_entries = new_allocated;
+		}
+
+		entries[n_entries].name = strdup(de->d_name);
+		entries[n_entries].node = NULL;
+		if (entries[n_entries].name == NULL) {
+			errsv = ENOMEM;
+			goto fail;
+		}
+		n_entries++;
+	}
+
+	if (lcfs_uring_build_statx(ctx, dfd, entries, n_entries,
+				   &failed_subpath) < 0) {
+		errsv = errno;
+		goto fail;
+	}
+
+	for (size_t i = 0; i < n_entries && !ctx->failed; i++) {
+		struct lcfs_uring_dirent_s *entry = &entries[i];
+		struct lcfs_node_s *n;
+		struct stat sb;
+		bool sparse;
+
+		stat_from_statx(&sb, &entry->stx);
+
+		if (ctx->buildflags & LCFS_BUILD_SKIP_DEVICES) {
+			if (S_ISBLK(sb.st_mode) || S_ISCHR(sb.st_mode))
+				continue;
+		}
+
+		/* Loaded as usual, to skip reading the holes */
+		sparse = lcfs_stat_is_sparse(&sb);
+
+		n = lcfs_load_node_or_link(ctx->links, dfd, entry->name, &sb,
+					   sparse ? ctx->buildflags : ctx->load_flags,
+					   ctx->digest_cache, ctx->arena, ctx->stats);
+		if (n == NULL) {
+			errsv = errno;
+			failed_subpath = entry->name;
+			goto fail;
+		}
+
+		r = lcfs_node_add_child(node, n, entry->name);
+		if (r < 0) {
+			errsv = errno;
+			lcfs_node_unref(n);
+			goto fail;
+		}
+
+		if (S_ISDIR(sb.st_mode)) {
+			entry->node = n;
+		} else if (S_ISREG(sb.st_mode) && n->link_to == NULL &&
+			   !sparse && sb.st_size > 0 &&
+			   ((ctx->buildflags & (LCFS_BUILD_COMPUTE_DIGEST |
+						LCFS_BUILD_BY_DIGEST)) != 0 ||
+			    ((ctx->buildflags & LCFS_BUILD_NO_INLINE) == 0 &&
+			     sb.st_size <= LCFS_BUILD_INLINE_FILE_SIZE_LIMIT))) {
+			if (lcfs_uring_build_add_file(ctx, dfd, entry->name, &sb, n) < 0) {
+				lcfs_uring_build_set_error(ctx, errno, entry->name);
+				break;
+			}
+		}
+	}
+
+	if (lcfs_uring_build_drain(ctx) < 0) {
+		errsv = errno;
+		failed_subpath = ctx->failed_name;
+		goto fail;
+	}
+
+	for (size_t i = 0; i < n_entries; i++) {
+		struct lcfs_uring_dirent_s *entry = &entries[i];
+
+		if (entry->node == NULL)
+			continue;
+
+		r = lcfs_uring_build_dir(ctx, entry->node, dfd, entry->name,
+					 &free_failed_subpath);
+		if (r < 0) {
+			errsv = errno;
+			failed_subpath = free_failed_subpath;
+			goto fail;
+		}
+	}
+
+	for (size_t i = 0; i < n_entries; i++)
+		free(entries[i].name);
+	free(entries);
+	closedir(dir);
+	return 0;
+
+fail:
+	/* Files that are still being read refer to the entries */
+	lcfs_uring_build_drain(ctx);
+	if (failed_path_out)
+		*failed_path_out = maybe_join_path(fname, failed_subpath);
+	free(free_failed_subpath);
+	for (size_t i = 0; i < n_entries; i++)
+		free(entries[i].name);
+	free(entries);
+	if (dir)
+		closedir(dir);
+	errno = errsv;
+	return -1;
+}
+
+static struct lcfs_node_s *lcfs_build_uring(int dirfd, const char *fname,
+					    int buildflags,
+					    struct lcfs_digest_cache_s *cache,
+					    lcfs_arena_t *arena,
+					    struct lcfs_build_stats_s *stats,
+					    struct lcfs_hardlinks_s *links,
+					    char **failed_path_out)
+{
+	struct lcfs_uring_build_s ctx = {
+		.buildflags = buildflags,
+		.load_flags = (buildflags & ~(LCFS_BUILD_COMPUTE_DIGEST |
+					      LCFS_BUILD_BY_DIGEST)) |
+			      LCFS_BUILD_NO_INLINE,
+		.digest_cache = cache,
+		.arena = arena,
+		.stats = stats,
+		.links = links,
+	};
+	cleanup_node struct lcfs_node_s *root = NULL;
+	int errsv = 0;
+
+	ctx.ring = lcfs_uring_new(URING_QUEUE_DEPTH);
+	if (ctx.ring == NULL) {
+		/* Not supported, or not allowed */
+		return lcfs_build_serial(dirfd, fname, NULL, buildflags, cache,
+					 arena, stats, links, failed_path_out);
+	}
+
+	root = lcfs_load_node(dirfd, fname, buildflags, cache, arena, stats);
+	if (root == NULL) {
+		errsv = errno;
+		if (failed_path_out)
+			*failed_path_out = maybe_join_path(fname, NULL);
+	} else if (lcfs_node_dirp(root) &&
+		   lcfs_uring_build_dir(&ctx, root, dirfd, fname, failed_path_out) < 0) {
+		errsv = errno;
+	}
+
+	for (size_t i = 0; i < URING_MAX_FILES; i++)
+		free(ctx.files[i].buffer);
+	free(ctx.failed_name);
+	lcfs_uring_free(ctx.ring);
+
+	if (errsv != 0) {
+		errno = errsv;
+		return NULL;
+	}
+
+	lcfs_hardlinks_reorder(links, root);
+
+	return steal_pointer(&root);
+}
+
+#endif
+
+struct lcfs_node_s *lcfs_build_with_options(int dirfd, const char *fname,
+					    struct lcfs_build_options_s *options,
+					    char **failed_path_out)
+{
+	struct lcfs_hardlinks_s links;
+	lcfs_arena_t *arena = NULL;
+	struct lcfs_node_s *root;
+	int errsv;
+
+	if (lcfs_hardlinks_init(&links) < 0) {
+		if (failed_path_out)
+			*failed_path_out = maybe_join_path(fname, NULL);
+		return NULL;
+	}
+
+	if (options->flags & LCFS_BUILD_USE_ARENA) {
+		arena = lcfs_arena_new();
+		if (arena == NULL) {
+			lcfs_hardlinks_destroy(&links);
+			if (failed_path_out)
+				*failed_path_out = maybe_join_path(fname, NULL);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	if (options->n_threads > 1)
+		root = lcfs_build_parallel(dirfd, fname, options->flags,
+					   options->n_threads, options->digest_cache,
+					   arena, options->stats, &links,
+					   failed_path_out);
+#ifdef HAVE_IO_URING
+	else if (options->flags & LCFS_BUILD_USE_IO_URING)
+		root = lcfs_build_uring(dirfd, fname, options->flags,
+					options->digest_cache, arena,
+					options->stats, &links, failed_path_out);
+#endif
+	else
+		root = lcfs_build_serial(dirfd, fname, NULL, options->flags,
+					 options->digest_cache, arena,
+					 options->stats, &links, failed_path_out);
+
+	errsv = errno;
+	lcfs_hardlinks_destroy(&links);
+	/* From here on the nodes keep the arena alive */
+	if (arena)
+		lcfs_arena_unref(arena);
+	errno = errsv;
+
+	return root;
+}
+
+size_t lcfs_node_get_n_xattr(struct lcfs_node_s *node)
+{
+	return node->n_xattrs;
+}
+
+const char *lcfs_node_get_xattr_name(struct lcfs_node_s *node, size_t index)
+{
+	if (index >= node->n_xattrs)
+		return NULL;
+
+	return node->xattrs[index].key;
+}
+
+static ssize_t find_xattr(struct lcfs_node_s *node, const char *name)
+{
+	ssize_t i;
+	for (i = 0; i < (ssize_t)node->n_xattrs; i++) {
+		struct lcfs_xattr_s *xattr = &node->xattrs[i];
+		if (strcmp(name, xattr->key) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *lcfs_node_get_xattr(struct lcfs_node_s *node, const char *name,
+				size_t *length)
+{
+	ssize_t index = find_xattr(node, name);
+
+	if (index >= 0) {
+		struct lcfs_xattr_s *xattr = &node->xattrs[index];
+		if (length)
+			*length = xattr->value_len;
+		return xattr->value;
+	}
+
+	return NULL;
+}
+
+int lcfs_node_unset_xattr(struct lcfs_node_s *node, const char *name)
+{
+	ssize_t index = find_xattr(node, name);
+
+	if (index >= 0) {
+		lcfs_intern_unref(node->xattrs[index].key);
+		lcfs_intern_unref(node->xattrs[index].value);
+		if (index != (ssize_t)node->n_xattrs - 1)
+			node->xattrs[index] = node->xattrs[node->n_xattrs - 1];
+		node->n_xattrs--;
+	}
+
+	return -1;
+}
+
+/* Like lcfs_node_grow_children() */
+static int lcfs_node_grow_xattrs(struct lcfs_node_s *node, size_t n_xattrs,
+				 bool exact)
+{
+	struct lcfs_xattr_s *new_xattrs;
+	size_t new_allocated;
+
+	if (n_xattrs <= node->xattrs_allocated)
+		return 0;
+
+	if (n_xattrs > UINT16_MAX) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Start out exact, most nodes have only one or two xattrs */
+	new_allocated = n_xattrs;
+	if (!exact)
+		new_allocated = MAX(new_allocated, node->xattrs_allocated * 2);
+
+	new_xattrs = reallocarray(node->xattrs, sizeof(struct lcfs_xattr_s),
+				  new_allocated);
+	if (new_xattrs == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	node->xattrs = new_xattrs;
+	node->xattrs_allocated = new_allocated;
+
+	return 0;
+}
+
+int lcfs_node_reserve_xattrs(struct lcfs_node_s *node, size_t n_xattrs)
+{
+	return lcfs_node_grow_xattrs(node, n_xattrs, true);
+}
+
+int lcfs_node_set_xattr(struct lcfs_node_s *node, const char *name,
+			const char *value, size_t value_len)
+{
+	struct lcfs_xattr_s *xattrs;
+	char *k, *v;
+	ssize_t index = find_xattr(node, name);
+
+	if (value_len > UINT16_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (index >= 0) {
+		/* Already set, replace */
+		struct lcfs_xattr_s *xattr = &node->xattrs[index];
+		v = lcfs_intern(value, value_len);
+		if (v == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		lcfs_intern_unref(xattr->value);
+		xattr->value = v;
+		xattr->value_len = value_len;
+
+		return 0;
+	}
+
+	if (lcfs_node_grow_xattrs(node, node->n_xattrs + 1, false) < 0)
+		return -1;
+	xattrs = node->xattrs;
+
+	k = lcfs_intern_string(name);
+	v = lcfs_intern(value, value_len);
+	if (k == NULL || v == NULL) {
+		lcfs_intern_unref(k);
+		lcfs_intern_unref(v);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	xattrs[node->n_xattrs].key = k;
+	xattrs[node->n_xattrs].value = v;
+	xattrs[node->n_xattrs].value_len = value_len;
+	node->n_xattrs++;
+
+	return 0;
+}
+
+/* This is an internal function.
+ * Be careful to not cause duplicates if new_name already exist */
+int lcfs_node_rename_xattr(struct lcfs_node_s *node, size_t index, const char *new_name)
+{
+	struct lcfs_xattr_s *xattr;
+	char *dup;
+
+	if (index >= node->n_xattrs) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	dup = lcfs_intern_string(new_name);
+	if (dup == NULL) {
+		errno = ENOMEM;
 		return -1;
 	}
 
 	xattr = &node->xattrs[index];
-	free(xattr->key);
-	xattr->key = steal_pointer(&dup);
+	lcfs_intern_unref(xattr->key);
+	xattr->key = dup;
 	return 0;
 }
@@ -37,6 +37,11 @@ enum {
 	LCFS_BUILD_NO_INLINE = (1 << 4),
 	LCFS_BUILD_USER_XATTRS = (1 << 5), /* Only read user.* xattrs */
 	LCFS_BUILD_BY_DIGEST = (1 << 6), /* Refer to basedir files by fs-verity digest */
+	LCFS_BUILD_MEASURE_DIGEST = (1 << 7), /* Use the kernel fs-verity digest if enabled */
+	LCFS_BUILD_LAZY_DIGEST = (1 << 8), /* Only use digests available without reading the file */
+	LCFS_BUILD_USE_ARENA = (1 << 9), /* Allocate the tree from a shared arena */
+	LCFS_BUILD_USE_IO_URING = (1 << 10), /* Read the source with io_uring, if available */
+	LCFS_BUILD_STAT_DONT_SYNC = (1 << 11), /* Allow cached attributes on network filesystems */
 };
 
 enum lcfs_format_t {
@@ -45,7 +50,9 @@ enum lcfs_format_t {
 
 enum lcfs_flags_t {
 	LCFS_FLAGS_NONE = 0,
-	LCFS_FLAGS_MASK = 0,
+	LCFS_FLAGS_WRITE_FD = (1 << 0), /* Write to file_fd, not file_write_cb */
+	LCFS_FLAGS_WRITE_MMAP = (1 << 1), /* Map file_fd if it is a regular file */
+	LCFS_FLAGS_MASK = LCFS_FLAGS_WRITE_FD | LCFS_FLAGS_WRITE_MMAP,
 };
 
 typedef ssize_t (*lcfs_read_cb)(void *file, void *buf, size_t count);
@@ -58,10 +65,34 @@ struct lcfs_write_options_s {
 	uint8_t *digest_out;
 	void *file;
 	lcfs_write_cb file_write_cb;
-	uint32_t reserved[4];
+	int32_t file_fd; /* With LCFS_FLAGS_WRITE_FD */
+	uint32_t n_threads; /* Used with LCFS_FLAGS_WRITE_MMAP, 0 or 1 means the calling thread */
+	uint32_t mapped; /* Out: set if LCFS_FLAGS_WRITE_MMAP mapped file_fd */
+	uint32_t reserved[1];
 	void *reserved2[4];
 };
 
+struct lcfs_digest_cache_s;
+
+/* Filled in by lcfs_build_with_options(). The syscalls are those
+ * used to load the files (stat, open, close, readlink, xattrs, reading
+ * inline content and reading content to hash it), not reading
+ * directories. */
+struct lcfs_build_stats_s {
+	uint64_t n_inodes;
+	uint64_t n_syscalls;
+	uint64_t reserved[6];
+};
+
+struct lcfs_build_options_s {
+	uint32_t flags; /* LCFS_BUILD_* */
+	uint32_t n_threads; /* 0 or 1 means build on the calling thread */
+	uint32_t reserved[4];
+	struct lcfs_digest_cache_s *digest_cache; /* Optional */
+	struct lcfs_build_stats_s *stats; /* Optional */
+	void *reserved2[2];
+};
+
 LCFS_EXTERN struct lcfs_node_s *lcfs_node_new(void);
 LCFS_EXTERN struct lcfs_node_s *lcfs_node_ref(struct lcfs_node_s *node);
 LCFS_EXTERN void lcfs_node_unref(struct lcfs_node_s *node);
@@ -79,6 +110,7 @@ LCFS_EXTERN int lcfs_node_set_xattr(struct lcfs_node_s *node, const char *name,
 				    const char *value, size_t value_len);
 LCFS_EXTERN int lcfs_node_unset_xattr(struct lcfs_node_s *node, const char *name);
 LCFS_EXTERN size_t lcfs_node_get_n_xattr(struct lcfs_node_s *node);
+LCFS_EXTERN int lcfs_node_reserve_xattrs(struct lcfs_node_s *node, size_t n_xattrs);
 LCFS_EXTERN const char *lcfs_node_get_xattr_name(struct lcfs_node_s *node,
 						 size_t index);
 
@@ -97,6 +129,8 @@ LCFS_EXTERN int lcfs_node_add_child(struct lcfs_node_s *parent,
 				    const char *name);
 LCFS_EXTERN const char *lcfs_node_get_name(struct lcfs_node_s *node);
 LCFS_EXTERN size_t lcfs_node_get_n_children(struct lcfs_node_s *node);
+LCFS_EXTERN int lcfs_node_reserve_children(struct lcfs_node_s *node,
+					   size_t n_children);
 LCFS_EXTERN struct lcfs_node_s *lcfs_node_get_child(struct lcfs_node_s *node,
 						    size_t i);
 LCFS_EXTERN void lcfs_node_make_hardlink(struct lcfs_node_s *node,
@@ -131,6 +165,10 @@ LCFS_EXTERN int lcfs_node_set_fsverity_from_fd(struct lcfs_node_s *node, int fd)
 
 LCFS_EXTERN struct lcfs_node_s *lcfs_build(int dirfd, const char *fname,
 					   int buildflags, char **failed_path_out);
+LCFS_EXTERN struct lcfs_node_s *
+lcfs_build_with_options(int dirfd, const char *fname,
+			struct lcfs_build_options_s *options,
+			char **failed_path_out);
 
 LCFS_EXTERN int lcfs_write_to(struct lcfs_node_s *root,
 			      struct lcfs_write_options_s *options);
@@ -141,5 +179,18 @@ LCFS_EXTERN int lcfs_compute_fsverity_from_content(uint8_t *digest, void *file,
 LCFS_EXTERN int lcfs_compute_fsverity_from_fd(uint8_t *digest, int fd);
 LCFS_EXTERN int lcfs_compute_fsverity_from_data(uint8_t *digest, uint8_t *data,
 						size_t data_len);
+LCFS_EXTERN int lcfs_compute_fsverity_parallel(uint8_t *digest, uint8_t *data,
+					       size_t data_len, size_t n_threads);
+LCFS_EXTERN int lcfs_measure_fsverity_from_fd(uint8_t *digest, int fd);
+
+/* Persistent cache of file digests, for incremental builds */
+LCFS_EXTERN struct lcfs_digest_cache_s *lcfs_digest_cache_open(const char *path);
+LCFS_EXTERN void lcfs_digest_cache_free(struct lcfs_digest_cache_s *cache);
+LCFS_EXTERN bool lcfs_digest_cache_lookup(struct lcfs_digest_cache_s *cache,
+					  const struct stat *st, uint8_t *digest);
+LCFS_EXTERN int lcfs_digest_cache_insert(struct lcfs_digest_cache_s *cache,
+					 const struct stat *st,
+					 const uint8_t *digest);
+LCFS_EXTERN int lcfs_digest_cache_save(struct lcfs_digest_cache_s *cache);
 
 #endif
@@ -0,0 +1,175 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "libcomposefs/lcfs-writer.h"
+
+#include <err.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+
+/* Measures the heap use per inode of a synthetic tree, similar to a
+ * typical OS image: mostly regular files with a backing path and a
+ * digest, some symlinks and a few devices, all with a selinux label.
+ */
+
+#define DEFAULT_N_DIRS 2000
+#define FILES_PER_DIR 100
+
+static const char *selinux_labels[] = {
+	"system_u:object_r:usr_t:s0",
+	"system_u:object_r:bin_t:s0",
+	"system_u:object_r:lib_t:s0",
+	"system_u:object_r:etc_t:s0",
+};
+
+static size_t heap_in_use(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+
+	return mi.uordblks + mi.hblkhd;
+}
+
+static void check(int res, const char *what)
+{
+	if (res < 0)
+		err(EXIT_FAILURE, "%s", what);
+}
+
+static void set_label(struct lcfs_node_s *node, size_t i)
+{
+	const char *label = selinux_labels[i % 4];
+
+	check(lcfs_node_set_xattr(node, "security.selinux", label, strlen(label)),
+	      "set xattr");
+}
+
+static struct lcfs_node_s *new_node(uint32_t mode, size_t i)
+{
+	struct lcfs_node_s *node = lcfs_node_new();
+	struct timespec mtime = { 1700000000, 0 };
+
+	if (node == NULL)
+		err(EXIT_FAILURE, "lcfs_node_new");
+
+	lcfs_node_set_mode(node, mode);
+	lcfs_node_set_mtime(node, &mtime);
+	set_label(node, i);
+
+	return node;
+}
+
+static struct lcfs_node_s *build_tree(size_t n_dirs, size_t *n_inodes_out)
+{
+	struct lcfs_node_s *root = new_node(S_IFDIR | 0755, 0);
+	size_t n_inodes = 1;
+	char name[64];
+
+	for (size_t d = 0; d < n_dirs; d++) {
+		struct lcfs_node_s *dir = new_node(S_IFDIR | 0755, d);
+
+		for (size_t f = 0; f < FILES_PER_DIR; f++) {
+			struct lcfs_node_s *child;
+			size_t i = d * FILES_PER_DIR + f;
+
+			snprintf(name, sizeof(name), "file-%zu", f);
+
+			if (f % 10 < 7) {
+				uint8_t digest[LCFS_DIGEST_SIZE];
+				char payload[128];
+
+				child = new_node(S_IFREG | 0644, i);
+				lcfs_node_set_size(child, 10000 + i);
+				for (size_t j = 0; j < LCFS_DIGEST_SIZE; j++)
+					digest[j] = (i >> (j % 4 * 8)) + j;
+				lcfs_node_set_fsverity_digest(child, digest);
+				snprintf(payload, sizeof(payload),
+					 "%02zx/%030zx%032zx", i % 256, i, i);
+				check(lcfs_node_set_payload(child, payload),
+				      "set payload");
+			} else if (f % 10 < 9) {
+				child = new_node(S_IFLNK | 0777, i);
+				check(lcfs_node_set_payload(child, "../some/target"),
+				      "set payload");
+			} else {
+				child = new_node(S_IFCHR | 0644, i);
+				lcfs_node_set_rdev(child, makedev(1, 3));
+			}
+
+			check(lcfs_node_add_child(dir, child, name), "add child");
+			n_inodes++;
+		}
+
+		snprintf(name, sizeof(name), "dir-%zu", d);
+		check(lcfs_node_add_child(root, dir, name), "add child");
+		n_inodes++;
+	}
+
+	*n_inodes_out = n_inodes;
+	return root;
+}
+
+/* The image layout is fully computed before the first write, so
+ * that is when the writer uses the most memory */
+static size_t write_heap;
+
+static ssize_t sample_write_cb(void *file, void *buf, size_t count)
+{
+	(void)file;
+	(void)buf;
+
+	if (write_heap == 0)
+		write_heap = heap_in_use();
+
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	struct lcfs_write_options_s options = { 0 };
+	struct lcfs_node_s *root;
+	size_t n_dirs = DEFAULT_N_DIRS;
+	size_t n_inodes;
+	size_t base, built;
+
+	if (argc > 1)
+		n_dirs = strtoul(argv[1], NULL, 10);
+
+	base = heap_in_use();
+	root = build_tree(n_dirs, &n_inodes);
+	built = heap_in_use();
+
+	options.format = LCFS_FORMAT_EROFS;
+	options.file_write_cb = sample_write_cb;
+	check(lcfs_write_to(root, &options), "lcfs_write_to");
+
+	lcfs_node_unref(root);
+
+	printf("inodes: %zu\n", n_inodes);
+	printf("built tree: %.1f bytes/inode\n",
+	       (double)(built - base) / n_inodes);
+	printf("while writing: %.1f bytes/inode\n",
+	       (double)(write_heap - base) / n_inodes);
+
+	return 0;
+}
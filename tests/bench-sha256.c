@@ -0,0 +1,317 @@
+/* lcfs
+   Copyright (C) 2023 Alexander Larsson <alexl@redhat.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "libcomposefs/lcfs-sha256.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#define BENCH_PAGES 16384 /* 64 MiB */
+#define VERIFY_PAGES 37 /* Not a multiple of any lane count */
+#define BATCH_SIZE 16
+
+static const struct {
+	const char *input;
+	const char *digest;
+} test_vectors[] = {
+	{ "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+	{ "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+	  "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+	{ "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+	  "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+};
+
+static void digest_to_string(const uint8_t *digest, char *buf)
+{
+	static const char hexchars[] = "0123456789abcdef";
+
+	for (int i = 0; i < LCFS_SHA256_DIGEST_LEN; i++) {
+		buf[i * 2] = hexchars[digest[i] >> 4];
+		buf[i * 2 + 1] = hexchars[digest[i] & 0xF];
+	}
+	buf[LCFS_SHA256_DIGEST_LEN * 2] = '\0';
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_data(uint8_t *data, size_t len)
+{
+	uint32_t x = 0x12345678;
+
+	for (size_t i = 0; i < len; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = x >> 24;
+	}
+}
+
+/* Returns the number of failures */
+static int verify_backend(const char *backend, const uint8_t *data,
+			  const uint8_t (*expected)[LCFS_SHA256_DIGEST_LEN],
+			  size_t n_expected)
+{
+	uint8_t digest[LCFS_SHA256_DIGEST_LEN];
+	char digest_str[LCFS_SHA256_DIGEST_LEN * 2 + 1];
+	int failures = 0;
+
+	for (size_t i = 0; i < sizeof(test_vectors) / sizeof(test_vectors[0]); i++) {
+		lcfs_sha256((const uint8_t *)test_vectors[i].input,
+			    strlen(test_vectors[i].input), digest);
+		digest_to_string(digest, digest_str);
+		if (strcmp(digest_str, test_vectors[i].digest) != 0) {
+			fprintf(stderr, "%s: wrong digest for test vector %zu\n",
+				backend, i);
+			failures++;
+		}
+	}
+
+	/* Every length up to a couple of blocks past a page, so all
+	 * tail/padding cases are covered */
+	for (size_t len = 0; len < n_expected; len++) {
+		lcfs_sha256(data, len, digest);
+		if (memcmp(digest, expected[len], LCFS_SHA256_DIGEST_LEN) != 0) {
+			fprintf(stderr, "%s: wrong digest for length %zu\n",
+				backend, len);
+			failures++;
+		}
+	}
+
+	lcfs_sha256_page(data, digest);
+	if (memcmp(digest, expected[LCFS_SHA256_PAGE_SIZE], LCFS_SHA256_DIGEST_LEN) != 0) {
+		fprintf(stderr, "%s: wrong page digest\n", backend);
+		failures++;
+	}
+
+	return failures;
+}
+
+static int verify_mb_backend(const char *backend, const uint8_t *data,
+			     const uint8_t (*expected)[LCFS_SHA256_DIGEST_LEN])
+{
+	const uint8_t *pages[VERIFY_PAGES];
+	uint8_t digests[VERIFY_PAGES][LCFS_SHA256_DIGEST_LEN];
+	int failures = 0;
+
+	for (size_t i = 0; i < VERIFY_PAGES; i++)
+		pages[i] = data + i * LCFS_SHA256_PAGE_SIZE;
+
+	/* Check every batch size, i.e. also how partial batches are handled */
+	for (size_t n_pages = 1; n_pages <= VERIFY_PAGES; n_pages++) {
+		memset(digests, 0, sizeof(digests));
+		lcfs_sha256_pages(pages, n_pages, digests);
+
+		for (size_t i = 0; i < n_pages; i++) {
+			if (memcmp(digests[i], expected[i], LCFS_SHA256_DIGEST_LEN) != 0) {
+				fprintf(stderr, "%s: wrong digest for page %zu of %zu\n",
+					backend, i, n_pages);
+				failures++;
+			}
+		}
+	}
+
+	return failures;
+}
+
+static void bench(const char *name, void (*func)(const uint8_t *, size_t, uint8_t *),
+		  const uint8_t *data)
+{
+	uint8_t digest[LCFS_SHA256_DIGEST_LEN];
+	double start, elapsed;
+
+	start = now();
+	for (size_t i = 0; i < BENCH_PAGES; i++)
+		func(data + i * LCFS_SHA256_PAGE_SIZE, LCFS_SHA256_PAGE_SIZE, digest);
+	elapsed = now() - start;
+
+	printf("%-20s %8.1f MiB/s\n", name,
+	       (BENCH_PAGES * (double)LCFS_SHA256_PAGE_SIZE) / (1024 * 1024) / elapsed);
+}
+
+static void hash_general(const uint8_t *data, size_t len, uint8_t *digest)
+{
+	lcfs_sha256(data, len, digest);
+}
+
+static void hash_page(const uint8_t *data, size_t len, uint8_t *digest)
+{
+	(void)len;
+	lcfs_sha256_page(data, digest);
+}
+
+static void bench_pages(const char *name, const uint8_t *data)
+{
+	uint8_t digests[BATCH_SIZE][LCFS_SHA256_DIGEST_LEN];
+	const uint8_t *pages[BATCH_SIZE];
+	double start, elapsed;
+
+	start = now();
+	for (size_t i = 0; i < BENCH_PAGES; i += BATCH_SIZE) {
+		for (size_t j = 0; j < BATCH_SIZE; j++)
+			pages[j] = data + (i + j) * LCFS_SHA256_PAGE_SIZE;
+		lcfs_sha256_pages(pages, BATCH_SIZE, digests);
+	}
+	elapsed = now() - start;
+
+	printf("%-20s %8.1f MiB/s\n", name,
+	       (BENCH_PAGES * (double)LCFS_SHA256_PAGE_SIZE) / (1024 * 1024) / elapsed);
+}
+
+#ifdef HAVE_OPENSSL
+static EVP_MD_CTX *md_ctx;
+
+static void hash_openssl(const uint8_t *data, size_t len, uint8_t *digest)
+{
+	EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL);
+	EVP_DigestUpdate(md_ctx, data, len);
+	EVP_DigestFinal_ex(md_ctx, digest, NULL);
+}
+#endif
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [--verify]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	const size_t n_expected = LCFS_SHA256_PAGE_SIZE + 2 * 64 + 1;
+	uint8_t(*expected)[LCFS_SHA256_DIGEST_LEN];
+	uint8_t(*expected_pages)[LCFS_SHA256_DIGEST_LEN];
+	const char *const *backends;
+	const char *const *mb_backends;
+	const char *best_backend;
+	bool verify_only = false;
+	uint8_t *data;
+	int failures = 0;
+
+	if (argc == 2 && strcmp(argv[1], "--verify") == 0) {
+		verify_only = true;
+	} else if (argc != 1) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	data = malloc((size_t)BENCH_PAGES * LCFS_SHA256_PAGE_SIZE);
+	expected = calloc(n_expected, LCFS_SHA256_DIGEST_LEN);
+	expected_pages = calloc(VERIFY_PAGES, LCFS_SHA256_DIGEST_LEN);
+	if (data == NULL || expected == NULL || expected_pages == NULL)
+		errx(EXIT_FAILURE, "Out of memory");
+
+	fill_data(data, (size_t)BENCH_PAGES * LCFS_SHA256_PAGE_SIZE);
+
+	/* The portable code is the reference for the others */
+	best_backend = lcfs_sha256_get_backend();
+	if (lcfs_sha256_set_backend("generic") < 0)
+		err(EXIT_FAILURE, "Failed to select generic backend");
+	for (size_t len = 0; len < n_expected; len++)
+		lcfs_sha256(data, len, expected[len]);
+	for (size_t i = 0; i < VERIFY_PAGES; i++)
+		lcfs_sha256_page(data + i * LCFS_SHA256_PAGE_SIZE, expected_pages[i]);
+
+#ifdef HAVE_OPENSSL
+	md_ctx = EVP_MD_CTX_create();
+	if (md_ctx == NULL)
+		errx(EXIT_FAILURE, "Out of memory");
+	if (!verify_only)
+		bench("openssl", hash_openssl, data);
+#endif
+
+	backends = lcfs_sha256_list_backends();
+	for (size_t i = 0; backends[i] != NULL; i++) {
+		char name[64];
+		int backend_failures;
+
+		if (lcfs_sha256_set_backend(backends[i]) < 0)
+			err(EXIT_FAILURE, "Failed to select backend %s", backends[i]);
+
+		backend_failures =
+			verify_backend(backends[i], data, expected, n_expected);
+		failures += backend_failures;
+
+		if (verify_only) {
+			printf("%s: %s\n", backends[i],
+			       backend_failures ? "FAILED" : "OK");
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "%s", backends[i]);
+		bench(name, hash_general, data);
+		snprintf(name, sizeof(name), "%s (page)", backends[i]);
+		bench(name, hash_page, data);
+	}
+
+	/* The multi-buffer code, with the default single page backend for
+	 * leftover pages */
+	if (lcfs_sha256_set_backend(best_backend) < 0)
+		err(EXIT_FAILURE, "Failed to select backend %s", best_backend);
+
+	if (!verify_only) {
+		lcfs_sha256_set_mb_backend(NULL);
+		bench_pages("pages (no mb)", data);
+	}
+
+	mb_backends = lcfs_sha256_list_mb_backends();
+	for (size_t i = 0; mb_backends[i] != NULL; i++) {
+		char name[64];
+		int backend_failures;
+
+		if (lcfs_sha256_set_mb_backend(mb_backends[i]) < 0)
+			err(EXIT_FAILURE, "Failed to select backend %s", mb_backends[i]);
+
+		backend_failures =
+			verify_mb_backend(mb_backends[i], data, expected_pages);
+		failures += backend_failures;
+
+		if (verify_only) {
+			printf("%s: %s\n", mb_backends[i],
+			       backend_failures ? "FAILED" : "OK");
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "pages (%s)", mb_backends[i]);
+		bench_pages(name, data);
+	}
+
+#ifdef HAVE_OPENSSL
+	EVP_MD_CTX_destroy(md_ctx);
+#endif
+	free(expected_pages);
+	free(expected);
+	free(data);
+
+	if (failures)
+		errx(EXIT_FAILURE, "%d digest mismatches", failures);
+
+	return 0;
+}
@@ -68,7 +68,224 @@ function  test_mount_digest () {
     fi
 }
 
-TESTS="test_inline test_objects test_mount_digest"
+# Ensure a threaded scan generates the same image
+function  test_threads () {
+    local dir=$1
+    local i
+    mkdir -p $dir/root/a/b/c $dir/root/d
+    for i in $(seq 100); do
+        echo $i > $dir/root/a/file-$i
+        echo $i > $dir/root/a/b/c/file-$i
+        dd if=/dev/zero bs=1 count=$((1000 + i)) 2>/dev/null > $dir/root/d/file-$i
+    done
+    ln -s file-1 $dir/root/a/link
+    # Large enough for the image to be written, and its digest
+    # computed, in several batches (over 256 blocks for the digest)
+    mkdir -p $dir/root/e
+    (cd $dir/root/e && seq 40000 | xargs touch)
+
+    # The threaded image is written in place by the thread pool, compare
+    # it with one written as a stream by a single thread
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --digest-store=$dir/objects $dir/root - > $dir/test-stream.cfs
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --stats --threads=4 --digest-store=$dir/objects $dir/root $dir/test-threads.cfs 2> $dir/stats
+    grep -q "^output mapped *yes$" $dir/stats || return 1
+    cmp $dir/test-stream.cfs $dir/test-threads.cfs || return 1
+
+    # The digest of the mapped image is computed by the thread pool,
+    # the streamed one as it is written
+    $BINDIR/mkcomposefs --print-digest-only $dir/root > $dir/digest
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --stats --threads=4 --print-digest $dir/root $dir/test-threads-inline.cfs > $dir/digest-threads 2> $dir/stats
+    grep -q "^output mapped *yes$" $dir/stats || return 1
+    test $(stat -c %s $dir/test-threads-inline.cfs) -gt $((256 * 4096)) || return 1
+    $BINDIR/mkcomposefs $dir/root - > $dir/test-inline.cfs
+    cmp $dir/test-inline.cfs $dir/test-threads-inline.cfs || return 1
+    cmp $dir/digest $dir/digest-threads
+}
+
+# Ensure kernel measured digests give the same image
+function  test_use_verity () {
+    local dir=$1
+
+    if [ $has_fsverity = y ]; then
+        dd if=/dev/urandom bs=1 count=10000 2>/dev/null > $dir/root/a-file
+        dd if=/dev/urandom bs=1 count=20000 2>/dev/null > $dir/root/b-file
+        fsverity enable $dir/root/a-file
+
+        makeimage $dir
+        ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --use-verity --digest-store=$dir/objects $dir/root $dir/test-verity.cfs
+
+        cmp $dir/test.cfs $dir/test-verity.cfs
+    fi
+}
+
+# Ensure cached digests give the same image, and changed files are rehashed
+function  test_digest_cache () {
+    local dir=$1
+    dd if=/dev/urandom bs=1 count=10000 2>/dev/null > $dir/root/a-file
+    dd if=/dev/urandom bs=1 count=20000 2>/dev/null > $dir/root/b-file
+    # Files changed in the last second are not cached
+    sleep 2
+
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --digest-cache=$dir/cache --digest-store=$dir/objects $dir/root $dir/test-cache1.cfs
+    test $(stat -c %s $dir/cache) = $((24 + 2 * 80))
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --digest-cache=$dir/cache --digest-store=$dir/objects $dir/root $dir/test-cache2.cfs
+    cmp $dir/test-cache1.cfs $dir/test-cache2.cfs
+
+    dd if=/dev/urandom bs=1 count=10000 2>/dev/null > $dir/root/a-file
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --digest-cache=$dir/cache --digest-store=$dir/objects $dir/root $dir/test-cache3.cfs
+    makeimage $dir
+    cmp $dir/test.cfs $dir/test-cache3.cfs
+}
+
+# Ensure a batch synced store has the same objects, and no leftovers
+function  test_batch_sync () {
+    local dir=$1
+    local i
+    for i in $(seq 20); do
+        dd if=/dev/urandom bs=1 count=$((1000 + i)) 2>/dev/null > $dir/root/file-$i
+    done
+    cp $dir/root/file-1 $dir/root/file-copy
+
+    makeimage $dir
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --batch-sync --threads=2 --digest-store=$dir/objects-batch $dir/root $dir/test-batch.cfs
+
+    cmp $dir/test.cfs $dir/test-batch.cfs
+    diff -r $dir/objects $dir/objects-batch
+}
+
+# Ensure large directories (with an index of children) load and round-trip
+function  test_large_dir () {
+    local dir=$1
+    mkdir $dir/root/d
+    (cd $dir/root/d && seq 2000 | xargs touch)
+
+    makeimage $dir
+
+    test $($BINDIR/composefs-info ls $dir/test.cfs | wc -l) = 2001
+    $BINDIR/composefs-dump $dir/test.cfs $dir/test-dump.cfs
+    cmp $dir/test.cfs $dir/test-dump.cfs
+}
+
+# Ensure a mapped output file and streamed output are the same
+function  test_output_modes () {
+    local dir=$1
+    local i
+    for i in $(seq 100); do
+        echo $i > $dir/root/file-$i
+        dd if=/dev/zero bs=1 count=$((1000 + i)) 2>/dev/null > $dir/root/large-file-$i
+    done
+    ln -s file-1 $dir/root/link
+
+    # Old content in the output file must not survive
+    dd if=/dev/urandom bs=1024 count=1024 2>/dev/null > $dir/test.cfs
+    local DIGEST=$(${VALGRIND_PREFIX} $BINDIR/mkcomposefs --stats --print-digest --digest-store=$dir/objects $dir/root $dir/test.cfs 2> $dir/stats)
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --stats --digest-store=$dir/objects $dir/root - > $dir/test-stream.cfs 2> $dir/stats-stream
+    local STREAM_DIGEST=$(${VALGRIND_PREFIX} $BINDIR/mkcomposefs --print-digest-only --digest-store=$dir/objects $dir/root)
+
+    # The file output must be written in place, stdout (opened write-only) streamed
+    grep -q "^output mapped *yes$" $dir/stats || return 1
+    grep -q "^output mapped *no$" $dir/stats-stream || return 1
+    cmp $dir/test.cfs $dir/test-stream.cfs || return 1
+    test "$DIGEST" = "$STREAM_DIGEST"
+}
+
+# Ensure reading the source with io_uring gives the same image
+function  test_io_uring () {
+    local dir=$1
+    local i
+    mkdir -p $dir/root/a/b $dir/root/d
+    for i in $(seq 200); do
+        echo $i > $dir/root/a/file-$i
+        dd if=/dev/urandom bs=1 count=$((100 * i)) 2>/dev/null > $dir/root/d/file-$i
+    done
+    ln -s file-1 $dir/root/a/b/link
+    touch $dir/root/a/empty
+
+    makeimage $dir
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --io-uring --digest-store=$dir/objects-uring $dir/root $dir/test-uring.cfs
+    cmp $dir/test.cfs $dir/test-uring.cfs || return 1
+    diff -r $dir/objects $dir/objects-uring || return 1
+
+    $BINDIR/mkcomposefs --print-digest-only $dir/root > $dir/digest
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --io-uring --print-digest-only $dir/root > $dir/digest-uring
+    cmp $dir/digest $dir/digest-uring
+}
+
+# Ensure hardlinks in the source are hardlinks in the image, whichever way it is built
+function  test_hardlinks () {
+    local dir=$1
+    local i
+    mkdir -p $dir/root/a/b $dir/root/c
+    for i in $(seq 20); do
+        dd if=/dev/urandom bs=1 count=$((100 * i)) 2>/dev/null > $dir/root/c/file-$i
+        ln $dir/root/c/file-$i $dir/root/a/b/link-$i
+        ln $dir/root/c/file-$i $dir/root/link-$i
+    done
+    ln -s file-1 $dir/root/c/symlink
+    ln $dir/root/c/symlink $dir/root/a/symlink
+
+    makeimage $dir
+    ${VALGRIND_PREFIX} $BINDIR/composefs-info dump $dir/test.cfs > $dir/dump
+    test $(grep -c " @" $dir/dump) = 41 || return 1
+    test $(countobjects $dir) = 20 || return 1
+
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --threads=4 $dir/root $dir/test-threads.cfs
+    cmp $dir/test.cfs $dir/test-threads.cfs || return 1
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --io-uring $dir/root $dir/test-uring.cfs
+    cmp $dir/test.cfs $dir/test-uring.cfs
+}
+
+# Ensure sparse files get the same digests as when all their zeros are stored
+function  test_sparse () {
+    local dir=$1
+    mkdir -p $dir/root $dir/dense
+    truncate -s 70M $dir/root/hole
+    truncate -s 8M $dir/root/sparse
+    dd if=/dev/urandom of=$dir/root/sparse bs=4096 seek=1000 count=3 conv=notrunc 2>/dev/null
+    dd if=/dev/urandom of=$dir/root/sparse bs=1 seek=$((6 * 1024 * 1024 + 7)) count=5000 conv=notrunc 2>/dev/null
+    dd if=/dev/urandom of=$dir/root/sparse-end bs=1 count=10 2>/dev/null
+    truncate -s $((64 * 1024 * 1024 + 12345)) $dir/root/sparse-end
+    cp --sparse=never $dir/root/* $dir/dense/
+
+    local DIGEST=$(${VALGRIND_PREFIX} $BINDIR/mkcomposefs --use-epoch --print-digest-only $dir/root)
+    local DENSE_DIGEST=$(${VALGRIND_PREFIX} $BINDIR/mkcomposefs --use-epoch --print-digest-only $dir/dense)
+    local URING_DIGEST=$(${VALGRIND_PREFIX} $BINDIR/mkcomposefs --use-epoch --io-uring --print-digest-only $dir/root)
+    test "$DIGEST" = "$DENSE_DIGEST" || return 1
+    test "$DIGEST" = "$URING_DIGEST"
+}
+
+# Ensure reading files directly gives the same digests as when filling the store
+function  test_read_buffer () {
+    local dir=$1
+    local size
+    mkdir -p $dir/root
+    for size in 0 1 4095 4096 4097 1048575 1048576 1048577 3000000; do
+        head -c $size /dev/urandom > $dir/root/file-$size
+    done
+
+    local STORE_DIGEST=$(${VALGRIND_PREFIX} $BINDIR/mkcomposefs --print-digest --digest-store=$dir/objects $dir/root $dir/test.cfs)
+    local DIGEST=$(${VALGRIND_PREFIX} $BINDIR/mkcomposefs --print-digest-only $dir/root)
+    test "$DIGEST" = "$STORE_DIGEST"
+}
+
+# Ensure --stats counts the loaded inodes, and --stat-dont-sync gives the same image
+function  test_stats () {
+    local dir=$1
+    local i
+    mkdir -p $dir/root/a $dir/root/b
+    for i in $(seq 20); do
+        echo $i > $dir/root/a/file-$i
+    done
+    ln -s file-1 $dir/root/b/link
+
+    makeimage $dir
+    ${VALGRIND_PREFIX} $BINDIR/mkcomposefs --stats --stat-dont-sync --digest-store=$dir/objects-stats $dir/root $dir/test-stats.cfs 2> $dir/stats
+    cmp $dir/test.cfs $dir/test-stats.cfs || return 1
+    grep -q "^inodes  *24$" $dir/stats || return 1
+    grep -q "^syscalls per inode  *[1-9]" $dir/stats
+}
+
+TESTS="test_inline test_objects test_mount_digest test_threads test_use_verity test_digest_cache test_batch_sync test_large_dir test_output_modes test_io_uring test_stats test_hardlinks test_sparse test_read_buffer"
 res=0
 for i in $TESTS; do
     testdir=$(mktemp -d $workdir/$i.XXXXXX)
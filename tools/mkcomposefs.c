@@ -21,6 +21,8 @@
 
 #include "libcomposefs/lcfs-writer.h"
 #include "libcomposefs/lcfs-utils.h"
+#include "libcomposefs/lcfs-pool.h"
+#include "libcomposefs/hash.h"
 
 #include <stdio.h>
 #include <linux/limits.h>
@@ -31,8 +33,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <linux/fsverity.h>
 #include <linux/fs.h>
 
@@ -124,14 +130,85 @@ static int write_to_fd(int fd, const char *content, ssize_t len)
 	return 0;
 }
 
-#define BUFSIZE 8192
-static int copy_file_data(int sfd, int dfd)
+/* How store objects were created, for --stats */
+enum copy_method {
+	COPY_REFLINK,
+	COPY_FILE_RANGE,
+	COPY_SENDFILE,
+	COPY_READ_WRITE,
+	COPY_HASHED, /* read/write while computing the digest */
+	COPY_EXISTING, /* Already in the store */
+	N_COPY_METHODS,
+};
+
+static const char *const copy_method_names[N_COPY_METHODS] = {
+	[COPY_REFLINK] = "reflink",
+	[COPY_FILE_RANGE] = "copy_file_range",
+	[COPY_SENDFILE] = "sendfile",
+	[COPY_READ_WRITE] = "read/write",
+	[COPY_HASHED] = "read/write with digest",
+	[COPY_EXISTING] = "already in store",
+};
+
+static atomic_size_t copy_stats[N_COPY_METHODS];
+
+#define COPY_BUFSIZE (1024 * 1024)
+#define COPY_CHUNK_SIZE (1024 * 1024 * 1024)
+
+typedef ssize_t (*copy_chunk_fn)(int sfd, int dfd, size_t len);
+
+static ssize_t copy_chunk_file_range(int sfd, int dfd, size_t len)
 {
-	char buffer[BUFSIZE];
+	return copy_file_range(sfd, NULL, dfd, NULL, len, 0);
+}
+
+static ssize_t copy_chunk_sendfile(int sfd, int dfd, size_t len)
+{
+	return sendfile(dfd, sfd, NULL, len);
+}
+
+/* Copies the rest of sfd, which is size bytes, with an in-kernel copy
+ * method. Returns 1 when done, or 0 if the method doesn't work for these
+ * files, in which case nothing was copied. */
+static int copy_file_data_in_kernel(int sfd, int dfd, off_t size,
+				    copy_chunk_fn copy_chunk)
+{
+	bool copied = false;
+	ssize_t res;
+
+	while (true) {
+		res = copy_chunk(sfd, dfd, COPY_CHUNK_SIZE);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!copied && (errno == EXDEV || errno == EINVAL ||
+					errno == ENOSYS || errno == EOPNOTSUPP))
+				return 0;
+			return -1;
+		}
+
+		/* Some files (e.g. in procfs) claim a size but copy nothing
+		 * in the kernel, leave those to the next method */
+		if (res == 0)
+			return (copied || size == 0) ? 1 : 0;
+
+		copied = true;
+	}
+}
+
+static int copy_file_data_read_write(int sfd, int dfd)
+{
+	cleanup_free char *buffer = NULL;
 	ssize_t bytes_read;
 
+	buffer = malloc(COPY_BUFSIZE);
+	if (buffer == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
 	while (true) {
-		bytes_read = read(sfd, buffer, BUFSIZE);
+		bytes_read = read(sfd, buffer, COPY_BUFSIZE);
 		if (bytes_read == -1) {
 			if (errno == EINTR)
 				continue;
@@ -148,6 +225,33 @@ static int copy_file_data(int sfd, int dfd)
 	return 0;
 }
 
+/* Copies sfd, which is size bytes, to the empty file dfd, using the
+ * cheapest method that works. Returns the copy_method used. */
+static int copy_file_data(int sfd, int dfd, off_t size)
+{
+	int res;
+
+	// First try reflinking, which is fast and efficient if available.
+	if (ioctl(dfd, FICLONE, sfd) == 0)
+		return COPY_REFLINK;
+
+	// Then in-kernel copies, which avoid copying to userspace and back
+	res = copy_file_data_in_kernel(sfd, dfd, size, copy_chunk_file_range);
+	if (res != 0)
+		return res < 0 ? res : COPY_FILE_RANGE;
+
+	res = copy_file_data_in_kernel(sfd, dfd, size, copy_chunk_sendfile);
+	if (res != 0)
+		return res < 0 ? res : COPY_SENDFILE;
+
+	// Fall back to copying bits by hand
+	res = copy_file_data_read_write(sfd, dfd);
+	if (res < 0)
+		return res;
+
+	return COPY_READ_WRITE;
+}
+
 static int join_paths(char **out, const char *path1, const char *path2)
 {
 	const char *sep = (path1[0] == '\0') ? "" : "/";
@@ -188,9 +292,149 @@ static void cleanup_unlink_freep(void *pp)
 }
 #define cleanup_unlink_free __attribute__((cleanup(cleanup_unlink_freep)))
 
-static int copy_file_with_dirs_if_needed(const char *src, const char *dst_base,
+static void digest_to_path(const uint8_t *csum, char *buf)
+{
+	static const char hexchars[] = "0123456789abcdef";
+	uint32_t i, j;
+
+	for (i = 0, j = 0; i < LCFS_DIGEST_SIZE; i++, j += 2) {
+		uint8_t byte = csum[i];
+		if (i == 1)
+			buf[j++] = '/';
+		buf[j] = hexchars[byte >> 4];
+		buf[j + 1] = hexchars[byte & 0xF];
+	}
+	buf[j] = '\0';
+}
+
+struct pending_object {
+	char *tmppath;
+	char *path;
+};
+
+struct store_ctx {
+	const char *digest_store_path;
+	struct lcfs_digest_cache_s *digest_cache;
+	lcfs_pool_t *pool; /* NULL when filling the store serially */
+
+	/* Payloads that some job is responsible for */
+	pthread_mutex_t lock;
+	Hash_table *claimed;
+
+	/* With batch_sync, objects are only renamed into place after a
+	 * syncfs() of the whole store */
+	bool batch_sync;
+	struct pending_object *pending;
+	size_t n_pending;
+	size_t pending_size;
+
+	/* Set once files had to be copied through userspace, from then on
+	 * they are hashed while copying to save reading them twice */
+	atomic_bool tee_copy;
+
+	atomic_bool failed;
+	int errsv;
+	char *failed_path;
+};
+
+struct store_job {
+	struct store_ctx *ctx;
+	struct lcfs_node_s *node;
+	char *path;
+};
+
+static int add_pending_object(struct store_ctx *ctx, char **tmppath,
+			      const char *pathbuf)
+{
+	struct pending_object *object;
+	char *path;
+
+	path = strdup(pathbuf);
+	if (path == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (ctx->n_pending == ctx->pending_size) {
+		size_t new_size = ctx->pending_size ? ctx->pending_size * 2 : 64;
+		struct pending_object *new_pending =
+			reallocarray(ctx->pending, new_size,
+				     sizeof(struct pending_object));
+		if (new_pending == NULL) {
+			pthread_mutex_unlock(&ctx->lock);
+			free(path);
+			errno = ENOMEM;
+			return -1;
+		}
+		ctx->pending = new_pending;
+		ctx->pending_size = new_size;
+	}
+
+	object = &ctx->pending[ctx->n_pending++];
+	object->tmppath = steal_pointer(tmppath);
+	object->path = path;
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return 0;
+}
+
+/* Moves a fully written temporary file into place in the store */
+static int install_object(struct store_ctx *ctx, int *dfd, char **tmppath,
+			  const char *pathbuf, bool try_enable_fsverity)
+{
+	struct stat statbuf;
+	int res;
+
+	/* Make sure file is readable by all */
+	res = fchmod(*dfd, 0644);
+	if (res < 0) {
+		return res;
+	}
+
+	if (!ctx->batch_sync) {
+		res = fsync(*dfd);
+		if (res < 0) {
+			return res;
+		}
+	}
+	cleanup_fdp(dfd);
+
+	if (try_enable_fsverity) {
+		/* Try to enable fsverity */
+		*dfd = open(*tmppath, O_CLOEXEC | O_RDONLY);
+		if (*dfd < 0) {
+			return -1;
+		}
+
+		if (fstat(*dfd, &statbuf) == 0) {
+			res = enable_verity(*dfd);
+			if (res < 0) {
+				/* Ignore errors, we're only trying to enable it */
+			}
+		}
+	}
+
+	/* Renamed by store_sync() */
+	if (ctx->batch_sync)
+		return add_pending_object(ctx, tmppath, pathbuf);
+
+	res = rename(*tmppath, pathbuf);
+	if (res < 0) {
+		return res;
+	}
+	// Avoid a spurious extra unlink() from the cleanup
+	free(steal_pointer(tmppath));
+
+	return 0;
+}
+
+static int copy_file_with_dirs_if_needed(struct store_ctx *ctx, const char *src,
 					 const char *dst, bool try_enable_fsverity)
 {
+	const char *dst_base = ctx->digest_store_path;
 	cleanup_free char *pathbuf = NULL;
 	cleanup_unlink_free char *tmppath = NULL;
 	int ret, res;
@@ -206,8 +450,11 @@ static int copy_file_with_dirs_if_needed(const char *src, const char *dst_base,
 	if (ret < 0)
 		return ret;
 
-	if (lstat(pathbuf, &statbuf) == 0)
-		return 0; /* Already exists, no need to copy */
+	if (lstat(pathbuf, &statbuf) == 0) {
+		/* Already exists, no need to copy */
+		copy_stats[COPY_EXISTING]++;
+		return 0;
+	}
 
 	ret = join_paths(&tmppath, dst_base, ".tmpXXXXXX");
 	if (ret < 0)
@@ -222,60 +469,281 @@ static int copy_file_with_dirs_if_needed(const char *src, const char *dst_base,
 		return -1;
 	}
 
-	// First try reflinking, which is fast and efficient if available.
-	if (ioctl(dfd, FICLONE, sfd) != 0) {
-		// Fall back to copying bits by hand
-		res = copy_file_data(sfd, dfd);
-		if (res < 0) {
-			return res;
-		}
-	}
-	cleanup_fdp(&sfd);
+	if (fstat(sfd, &statbuf) < 0)
+		return -1;
 
-	/* Make sure file is readable by all */
-	res = fchmod(dfd, 0644);
+	res = copy_file_data(sfd, dfd, statbuf.st_size);
 	if (res < 0) {
 		return res;
 	}
+	copy_stats[res]++;
+	cleanup_fdp(&sfd);
 
-	res = fsync(dfd);
-	if (res < 0) {
+	return install_object(ctx, &dfd, &tmppath, pathbuf, try_enable_fsverity);
+}
+
+struct tee_file {
+	int sfd;
+	int dfd;
+	int write_errno;
+};
+
+/* Read callback for lcfs_compute_fsverity_from_content() that also
+ * writes everything it reads to the destination */
+static ssize_t tee_read_cb(void *_file, void *buf, size_t count)
+{
+	struct tee_file *file = _file;
+	ssize_t res;
+
+	do
+		res = read(file->sfd, buf, count);
+	while (res < 0 && errno == EINTR);
+
+	if (res > 0 && write_to_fd(file->dfd, buf, res) < 0) {
+		file->write_errno = errno;
+		return -1;
+	}
+
+	return res;
+}
+
+static size_t claimed_ht_hasher(const void *d, size_t n)
+{
+	return hash_string(d, n);
+}
+
+static bool claimed_ht_comparator(const void *d1, const void *d2)
+{
+	return strcmp(d1, d2) == 0;
+}
+
+/* Returns 1 if the caller should create the object for payload, 0 if
+ * some other job already does */
+static int store_claim(struct store_ctx *ctx, const char *payload)
+{
+	char *key;
+	int res;
+
+	key = strdup(payload);
+	if (key == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	res = hash_insert_if_absent(ctx->claimed, key, NULL);
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (res != 1)
+		free(key);
+	if (res < 0)
+		errno = ENOMEM;
+
+	return res;
+}
+
+/* Hashes sfd while copying it to a new temporary file in the store,
+ * for when in-kernel copies don't work. That way the source is only
+ * read once, but the copy is made before we can tell it is a duplicate. */
+static int hash_while_copying(struct store_ctx *ctx, int sfd, char **tmppath,
+			      int *dfd, uint8_t *digest)
+{
+	struct tee_file file = { .sfd = sfd };
+	int ret, res;
+
+	ret = join_paths(tmppath, ctx->digest_store_path, ".tmpXXXXXX");
+	if (ret < 0)
+		return ret;
+
+	ret = mkdir_parents(*tmppath, 0755);
+	if (ret < 0)
+		return ret;
+
+	*dfd = mkostemp(*tmppath, O_CLOEXEC);
+	if (*dfd == -1)
+		return -1;
+
+	file.dfd = *dfd;
+	res = lcfs_compute_fsverity_from_content(digest, &file, tee_read_cb);
+	if (res < 0 && file.write_errno != 0)
+		errno = file.write_errno;
+
+	return res;
+}
+
+/* For files that we don't know the digest of yet. The digest is
+ * computed first, so duplicates and objects already in the store are
+ * never copied, and then the file is copied with copy_file_data(),
+ * which doesn't read it into userspace again unless it has to. */
+static int hash_and_copy_file(struct store_ctx *ctx, struct lcfs_node_s *node,
+			      const char *src, bool try_enable_fsverity)
+{
+	const char *dst_base = ctx->digest_store_path;
+	cleanup_free char *pathbuf = NULL;
+	cleanup_unlink_free char *tmppath = NULL;
+	cleanup_fd int sfd = -1;
+	cleanup_fd int dfd = -1;
+	uint8_t digest[LCFS_DIGEST_SIZE];
+	char digest_path[LCFS_DIGEST_SIZE * 2 + 2];
+	struct stat statbuf;
+	struct stat dststat;
+	int ret, res, method;
+
+	sfd = open(src, O_CLOEXEC | O_RDONLY);
+	if (sfd == -1) {
+		return -1;
+	}
+
+	if (fstat(sfd, &statbuf) < 0)
+		return -1;
+
+	if (atomic_load(&ctx->tee_copy))
+		res = hash_while_copying(ctx, sfd, &tmppath, &dfd, digest);
+	else
+		res = lcfs_compute_fsverity_from_fd(digest, sfd);
+	if (res < 0)
+		return res;
+
+	digest_to_path(digest, digest_path);
+	lcfs_node_set_fsverity_digest(node, digest);
+	res = lcfs_node_set_payload(node, digest_path);
+	if (res < 0)
+		return res;
+
+	if (ctx->digest_cache &&
+	    lcfs_digest_cache_insert(ctx->digest_cache, &statbuf, digest) < 0)
+		return -1;
+
+	res = store_claim(ctx, digest_path);
+	if (res <= 0) {
+		if (res == 0)
+			copy_stats[COPY_EXISTING]++;
 		return res;
 	}
-	cleanup_fdp(&dfd);
 
-	if (try_enable_fsverity) {
-		/* Try to enable fsverity */
-		dfd = open(tmppath, O_CLOEXEC | O_RDONLY);
-		if (dfd < 0) {
+	ret = join_paths(&pathbuf, dst_base, digest_path);
+	if (ret < 0)
+		return ret;
+
+	ret = mkdir_parents(pathbuf, 0755);
+	if (ret < 0)
+		return ret;
+
+	if (lstat(pathbuf, &dststat) == 0) {
+		/* Already exists, any temporary file is unlinked */
+		copy_stats[COPY_EXISTING]++;
+		return 0;
+	}
+
+	if (dfd >= 0) {
+		method = COPY_HASHED;
+	} else {
+		ret = join_paths(&tmppath, dst_base, ".tmpXXXXXX");
+		if (ret < 0)
+			return ret;
+
+		dfd = mkostemp(tmppath, O_CLOEXEC);
+		if (dfd == -1)
 			return -1;
-		}
 
-		if (fstat(dfd, &statbuf) == 0) {
-			res = enable_verity(dfd);
-			if (res < 0) {
-				/* Ignore errors, we're only trying to enable it */
-			}
-		}
+		if (lseek(sfd, 0, SEEK_SET) < 0)
+			return -1;
+
+		method = copy_file_data(sfd, dfd, statbuf.st_size);
+		if (method < 0)
+			return method;
+		if (method == COPY_READ_WRITE)
+			atomic_store(&ctx->tee_copy, true);
 	}
+	copy_stats[method]++;
+	cleanup_fdp(&sfd);
 
-	res = rename(tmppath, pathbuf);
-	if (res < 0) {
-		return res;
+	return install_object(ctx, &dfd, &tmppath, pathbuf, try_enable_fsverity);
+}
+
+static void store_set_error(struct store_ctx *ctx, int errsv, const char *path)
+{
+	pthread_mutex_lock(&ctx->lock);
+	if (!atomic_load(&ctx->failed)) {
+		ctx->errsv = errsv;
+		ctx->failed_path = strdup(path);
+		atomic_store(&ctx->failed, true);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static void store_job_run(void *data)
+{
+	cleanup_free struct store_job *job = data;
+	cleanup_free char *path = job->path;
+	struct store_ctx *ctx = job->ctx;
+	const char *payload;
+	int ret;
+
+	if (atomic_load(&ctx->failed))
+		return;
+
+	payload = lcfs_node_get_payload(job->node);
+	if (payload != NULL)
+		ret = copy_file_with_dirs_if_needed(ctx, path, payload, true);
+	else
+		/* Left without digest by LCFS_BUILD_LAZY_DIGEST */
+		ret = hash_and_copy_file(ctx, job->node, path, true);
+	if (ret < 0)
+		store_set_error(ctx, errno, path);
+}
+
+static int store_push_job(struct store_ctx *ctx, struct lcfs_node_s *node,
+			  const char *path)
+{
+	struct store_job *job;
+
+	job = calloc(1, sizeof(struct store_job));
+	if (job == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	job->ctx = ctx;
+	job->node = node;
+	job->path = strdup(path);
+	if (job->path == NULL) {
+		free(job);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (ctx->pool == NULL) {
+		store_job_run(job);
+		return atomic_load(&ctx->failed) ? -1 : 0;
+	}
+
+	if (lcfs_pool_push(ctx->pool, store_job_run, job) < 0) {
+		free(job->path);
+		free(job);
+		return -1;
 	}
-	// Avoid a spurious extra unlink() from the cleanup
-	free(steal_pointer(&tmppath));
 
 	return 0;
 }
 
-static int fill_store(struct lcfs_node_s *node, const char *path,
-		      const char *digest_store_path)
+/* Walks the tree and creates a job for each object that is missing from
+ * the store. Objects with a known payload are only handed to one job. */
+static int fill_store_walk(struct store_ctx *ctx, struct lcfs_node_s *node,
+			   const char *path)
 {
 	cleanup_free char *tmp_path = NULL;
 	const char *fname;
+	const char *payload;
 	int ret;
 
+	if (atomic_load(&ctx->failed))
+		return -1;
+
+	/* The content is stored for the node it links to */
+	if (lcfs_node_get_hardlink_target(node) != NULL)
+		return 0;
+
 	fname = lcfs_node_get_name(node);
 	if (fname) {
 		ret = join_paths(&tmp_path, path, fname);
@@ -288,17 +756,25 @@ static int fill_store(struct lcfs_node_s *node, const char *path,
 		size_t n_children = lcfs_node_get_n_children(node);
 		for (size_t i = 0; i < n_children; i++) {
 			struct lcfs_node_s *child = lcfs_node_get_child(node, i);
-			ret = fill_store(child, path, digest_store_path);
+			ret = fill_store_walk(ctx, child, path);
 			if (ret < 0)
 				return ret;
 		}
 	} else if ((lcfs_node_get_mode(node) & S_IFMT) == S_IFREG &&
 		   lcfs_node_get_content(node) == NULL &&
-		   lcfs_node_get_payload(node) != NULL) {
-		const char *payload = lcfs_node_get_payload(node);
+		   (lcfs_node_get_payload(node) != NULL ||
+		    lcfs_node_get_size(node) > 0)) {
+		payload = lcfs_node_get_payload(node);
+		if (payload != NULL) {
+			ret = store_claim(ctx, payload);
+			if (ret <= 0) {
+				if (ret == 0)
+					copy_stats[COPY_EXISTING]++;
+				return ret;
+			}
+		}
 
-		ret = copy_file_with_dirs_if_needed(path, digest_store_path,
-						    payload, true);
+		ret = store_push_job(ctx, node, path);
 		if (ret < 0)
 			return ret;
 	}
@@ -306,6 +782,160 @@ static int fill_store(struct lcfs_node_s *node, const char *path,
 	return 0;
 }
 
+static int cmp_pending_objects(const void *a, const void *b)
+{
+	const struct pending_object *pa = a;
+	const struct pending_object *pb = b;
+
+	return strcmp(pa->path, pb->path);
+}
+
+static int fsync_dir(const char *path)
+{
+	cleanup_fd int fd = -1;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	return fsync(fd);
+}
+
+/* Makes the pending objects durable. Their content is flushed with a
+ * single syncfs() before they get their final names, so a crash can
+ * never leave a truncated object in the store, only temporary files.
+ * Then the renames are flushed with an fsync of each fan-out directory
+ * that was touched, and of the store itself for new fan-out directories. */
+static int store_sync(struct store_ctx *ctx)
+{
+	cleanup_fd int store_fd = -1;
+	const char *last_path = NULL;
+	size_t last_dir_len = 0;
+
+	if (ctx->n_pending == 0)
+		return 0;
+
+	store_fd = open(ctx->digest_store_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (store_fd < 0 || syncfs(store_fd) < 0) {
+		store_set_error(ctx, errno, ctx->digest_store_path);
+		return -1;
+	}
+
+	/* Sorted so that each fan-out directory is synced once */
+	qsort(ctx->pending, ctx->n_pending, sizeof(struct pending_object),
+	      cmp_pending_objects);
+
+	for (size_t i = 0; i < ctx->n_pending; i++) {
+		struct pending_object *object = &ctx->pending[i];
+
+		if (rename(object->tmppath, object->path) < 0) {
+			store_set_error(ctx, errno, object->path);
+			return -1;
+		}
+		free(steal_pointer(&object->tmppath));
+	}
+
+	for (size_t i = 0; i < ctx->n_pending; i++) {
+		const char *path = ctx->pending[i].path;
+		size_t dir_len = strrchr(path, '/') - path;
+		cleanup_free char *dir = NULL;
+
+		if (last_path != NULL && dir_len == last_dir_len &&
+		    memcmp(path, last_path, dir_len) == 0)
+			continue;
+		last_path = path;
+		last_dir_len = dir_len;
+
+		dir = strndup(path, dir_len);
+		if (dir == NULL) {
+			store_set_error(ctx, ENOMEM, path);
+			return -1;
+		}
+
+		if (fsync_dir(dir) < 0) {
+			store_set_error(ctx, errno, dir);
+			return -1;
+		}
+	}
+
+	if (fsync(store_fd) < 0) {
+		store_set_error(ctx, errno, ctx->digest_store_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Objects that were never renamed into place are removed */
+static void free_pending_objects(struct store_ctx *ctx)
+{
+	for (size_t i = 0; i < ctx->n_pending; i++) {
+		struct pending_object *object = &ctx->pending[i];
+
+		if (object->tmppath) {
+			(void)unlink(object->tmppath);
+			free(object->tmppath);
+		}
+		free(object->path);
+	}
+	free(ctx->pending);
+}
+
+static int fill_store(struct lcfs_node_s *root, const char *path,
+		      const char *digest_store_path,
+		      struct lcfs_digest_cache_s *digest_cache, size_t n_threads,
+		      bool batch_sync)
+{
+	struct store_ctx ctx = {
+		.digest_store_path = digest_store_path,
+		.digest_cache = digest_cache,
+		.batch_sync = batch_sync,
+	};
+	int ret;
+
+	ctx.claimed = hash_initialize(0, NULL, claimed_ht_hasher,
+				      claimed_ht_comparator, free);
+	if (ctx.claimed == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	if (n_threads > 1) {
+		ctx.pool = lcfs_pool_new(n_threads);
+		if (ctx.pool == NULL)
+			store_set_error(&ctx, errno, path);
+	}
+
+	if (!atomic_load(&ctx.failed)) {
+		ret = fill_store_walk(&ctx, root, path);
+		if (ret < 0 && !atomic_load(&ctx.failed))
+			store_set_error(&ctx, errno, path);
+	}
+
+	if (ctx.pool) {
+		lcfs_pool_wait(ctx.pool);
+		lcfs_pool_free(ctx.pool);
+	}
+
+	if (!atomic_load(&ctx.failed))
+		store_sync(&ctx);
+
+	free_pending_objects(&ctx);
+	pthread_mutex_destroy(&ctx.lock);
+	hash_free(ctx.claimed);
+
+	if (atomic_load(&ctx.failed)) {
+		fprintf(stderr, "Failed to copy %s to store\n",
+			ctx.failed_path ? ctx.failed_path : path);
+		free(ctx.failed_path);
+		errno = ctx.errsv;
+		return -1;
+	}
+
+	return 0;
+}
+
 static void usage(const char *argv0)
 {
 	const char *bin = basename(argv0);
@@ -317,7 +947,14 @@ static void usage(const char *argv0)
 		"  --skip-xattrs         Don't store file xattrs\n"
 		"  --user-xattrs         Only store user.* xattrs\n"
 		"  --print-digest        Print the digest of the image\n"
-		"  --print-digest-only   Print the digest of the image, don't write image\n",
+		"  --print-digest-only   Print the digest of the image, don't write image\n"
+		"  --threads=N           Use N threads to scan and hash the source, fill the store and write the image\n"
+		"  --use-verity          Use the kernel fs-verity digest of files that have it\n"
+		"  --digest-cache=PATH   Cache file digests in this file between builds\n"
+		"  --stats               Print syscalls used to scan the source, and how files were copied to the digest store\n"
+		"  --batch-sync          Sync the digest store once at the end, not every file\n"
+		"  --io-uring            Scan the source with io_uring, if available\n"
+		"  --stat-dont-sync      Allow cached file attributes on network filesystems\n",
 		bin);
 }
 
@@ -328,13 +965,13 @@ static void usage(const char *argv0)
 #define OPT_PRINT_DIGEST 109
 #define OPT_PRINT_DIGEST_ONLY 111
 #define OPT_USER_XATTRS 112
-
-static ssize_t write_cb(void *_file, void *buf, size_t count)
-{
-	FILE *file = _file;
-
-	return fwrite(buf, 1, count, file);
-}
+#define OPT_THREADS 113
+#define OPT_USE_VERITY 114
+#define OPT_DIGEST_CACHE 115
+#define OPT_STATS 116
+#define OPT_BATCH_SYNC 117
+#define OPT_IO_URING 118
+#define OPT_STAT_DONT_SYNC 119
 
 int main(int argc, char **argv)
 {
@@ -381,25 +1018,76 @@ int main(int argc, char **argv)
 			flag: NULL,
 			val: OPT_PRINT_DIGEST_ONLY
 		},
+		{
+			name: "threads",
+			has_arg: required_argument,
+			flag: NULL,
+			val: OPT_THREADS
+		},
+		{
+			name: "use-verity",
+			has_arg: no_argument,
+			flag: NULL,
+			val: OPT_USE_VERITY
+		},
+		{
+			name: "digest-cache",
+			has_arg: required_argument,
+			flag: NULL,
+			val: OPT_DIGEST_CACHE
+		},
+		{
+			name: "stats",
+			has_arg: no_argument,
+			flag: NULL,
+			val: OPT_STATS
+		},
+		{
+			name: "batch-sync",
+			has_arg: no_argument,
+			flag: NULL,
+			val: OPT_BATCH_SYNC
+		},
+		{
+			name: "io-uring",
+			has_arg: no_argument,
+			flag: NULL,
+			val: OPT_IO_URING
+		},
+		{
+			name: "stat-dont-sync",
+			has_arg: no_argument,
+			flag: NULL,
+			val: OPT_STAT_DONT_SYNC
+		},
 		{},
 	};
 	struct lcfs_write_options_s options = { 0 };
+	struct lcfs_build_options_s build_options = { 0 };
+	struct lcfs_build_stats_s build_stats = { 0 };
 	const char *bin = argv[0];
 	int buildflags = 0;
+	char *endptr;
+	long n_threads;
 	bool print_digest = false;
 	bool print_digest_only = false;
+	bool print_stats = false;
+	bool batch_sync = false;
 	struct lcfs_node_s *root;
 	const char *out = NULL;
 	const char *dir_path = NULL;
 	const char *digest_store_path = NULL;
+	const char *digest_cache_path = NULL;
 	cleanup_free char *pathbuf = NULL;
 	uint8_t digest[LCFS_DIGEST_SIZE];
 	int opt;
-	FILE *out_file;
+	int out_fd;
 	char *failed_path;
 
 	/* We always compute the digest and reference by digest */
 	buildflags |= LCFS_BUILD_COMPUTE_DIGEST | LCFS_BUILD_BY_DIGEST;
+	/* The tree is only freed at the end */
+	buildflags |= LCFS_BUILD_USE_ARENA;
 
 	while ((opt = getopt_long(argc, argv, ":CR", longopts, NULL)) != -1) {
 		switch (opt) {
@@ -424,6 +1112,32 @@ int main(int argc, char **argv)
 		case OPT_PRINT_DIGEST_ONLY:
 			print_digest = print_digest_only = true;
 			break;
+		case OPT_THREADS:
+			errno = 0;
+			n_threads = strtol(optarg, &endptr, 10);
+			if (errno != 0 || *endptr != '\0' || endptr == optarg ||
+			    n_threads < 1 || n_threads > UINT16_MAX)
+				errx(EXIT_FAILURE, "Invalid number of threads: %s", optarg);
+			build_options.n_threads = n_threads;
+			break;
+		case OPT_USE_VERITY:
+			buildflags |= LCFS_BUILD_MEASURE_DIGEST;
+			break;
+		case OPT_DIGEST_CACHE:
+			digest_cache_path = optarg;
+			break;
+		case OPT_STATS:
+			print_stats = true;
+			break;
+		case OPT_BATCH_SYNC:
+			batch_sync = true;
+			break;
+		case OPT_IO_URING:
+			buildflags |= LCFS_BUILD_USE_IO_URING;
+			break;
+		case OPT_STAT_DONT_SYNC:
+			buildflags |= LCFS_BUILD_STAT_DONT_SYNC;
+			break;
 		case ':':
 			fprintf(stderr, "option needs a value\n");
 			exit(EXIT_FAILURE);
@@ -470,27 +1184,71 @@ int main(int argc, char **argv)
 	assert(out || print_digest_only);
 
 	if (print_digest_only) {
-		out_file = NULL;
+		out_fd = -1;
 	} else if (strcmp(out, "-") == 0) {
 		if (isatty(1))
 			errx(EXIT_FAILURE, "stdout is a tty.  Refusing to use it");
-		out_file = stdout;
+		out_fd = STDOUT_FILENO;
 	} else {
-		out_file = fopen(out, "we");
-		if (out_file == NULL)
+		out_fd = open(out, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (out_fd < 0)
 			err(EXIT_FAILURE, "failed to open output file");
 	}
 
-	root = lcfs_build(AT_FDCWD, dir_path, buildflags, &failed_path);
+	/* When filling the store the digests that need reading the file
+	 * are computed by the store jobs, which have the file open to copy
+	 * it anyway, not by lcfs_build() */
+	if (digest_store_path)
+		buildflags |= LCFS_BUILD_LAZY_DIGEST;
+
+	build_options.flags = buildflags;
+	if (print_stats)
+		build_options.stats = &build_stats;
+
+	if (digest_cache_path) {
+		build_options.digest_cache = lcfs_digest_cache_open(digest_cache_path);
+		if (build_options.digest_cache == NULL)
+			err(EXIT_FAILURE, "failed to open digest cache %s",
+			    digest_cache_path);
+	}
+
+	root = lcfs_build_with_options(AT_FDCWD, dir_path, &build_options,
+				       &failed_path);
 	if (root == NULL)
 		err(EXIT_FAILURE, "error accessing %s", failed_path);
 
-	if (digest_store_path && fill_store(root, dir_path, digest_store_path) < 0)
+	if (digest_store_path &&
+	    fill_store(root, dir_path, digest_store_path,
+		       build_options.digest_cache, build_options.n_threads,
+		       batch_sync) < 0)
 		err(EXIT_FAILURE, "cannot fill store");
 
-	if (out_file) {
-		options.file = out_file;
-		options.file_write_cb = write_cb;
+	if (print_stats) {
+		fprintf(stderr, "%-24s %" PRIu64 "\n", "inodes", build_stats.n_inodes);
+		fprintf(stderr, "%-24s %" PRIu64 "\n", "syscalls", build_stats.n_syscalls);
+		fprintf(stderr, "%-24s %.2f\n", "syscalls per inode",
+			build_stats.n_inodes > 0 ?
+				(double)build_stats.n_syscalls / build_stats.n_inodes :
+				0.0);
+	}
+
+	if (digest_store_path && print_stats) {
+		for (int i = 0; i < N_COPY_METHODS; i++)
+			fprintf(stderr, "%-24s %zu\n", copy_method_names[i],
+				atomic_load(&copy_stats[i]));
+	}
+
+	if (build_options.digest_cache) {
+		if (lcfs_digest_cache_save(build_options.digest_cache) < 0)
+			err(EXIT_FAILURE, "failed to save digest cache %s",
+			    digest_cache_path);
+		lcfs_digest_cache_free(build_options.digest_cache);
+	}
+
+	if (out_fd >= 0) {
+		options.flags |= LCFS_FLAGS_WRITE_FD | LCFS_FLAGS_WRITE_MMAP;
+		options.file_fd = out_fd;
+		options.n_threads = build_options.n_threads;
 	}
 	if (print_digest)
 		options.digest_out = digest;
@@ -500,6 +1258,13 @@ int main(int argc, char **argv)
 	if (lcfs_write_to(root, &options) < 0)
 		err(EXIT_FAILURE, "cannot write file");
 
+	if (print_stats && out_fd >= 0)
+		fprintf(stderr, "%-24s %s\n", "output mapped",
+			options.mapped ? "yes" : "no");
+
+	if (out_fd >= 0 && out_fd != STDOUT_FILENO && close(out_fd) < 0)
+		err(EXIT_FAILURE, "cannot write file");
+
 	if (print_digest) {
 		char digest_str[LCFS_DIGEST_SIZE * 2 + 1] = { 0 };
 		digest_to_string(digest, digest_str);